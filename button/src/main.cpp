@@ -1,7 +1,15 @@
 #define HB_TIMEOUT 7500
+#define IDLE_CLOCK_GATING 1 // 1 - FLASH AND SRAM (NOT WITH DEBUG_LOGGING) INTERFACE CLOCKS ARE STOPPED WHILE SLEEPING
+#define IDLE_STATS_WINDOW 1000 // MILLISECONDS IDLE TIME IS AVERAGED OVER
+#define DEBOUNCE_TIME 20 // MILLISECONDS THE BUTTON HAS TO BE STABLE AFTER THE LAST EDGE
+#define LONG_PRESS_TIME 1000 // MILLISECONDS, AT MOST 6500
+#define DOUBLE_PRESS_TIME 400 // MILLISECONDS BETWEEN RELEASE AND THE NEXT PRESS
+#define EVENT_QUEUE_SIZE 32 // MUST BE A POWER OF 2
+#define EVENT_READ_MAX 8 // EVENTS PER READ, THE RESPONSE IS ALWAYS 6 + 5 * N BYTES, MUST FIT I2C_TXRX_BUFFER_SIZE
 
 #include <Arduino.h>
 #include <Wire.h>
+#include "DebugLog.h"
 
 #define DEBUG_SWITCH_PIN PA11
 
@@ -10,24 +18,89 @@
 #define ERROR_LED_PIN PB14
 
 #define BUTTON_PIN PB8
+#define ATTENTION_PIN PA4 // OPEN-DRAIN, ACTIVE LOW, CAN BE SHARED WITH OTHER COMPONENTS
 
 #define PER_SDA_PIN PB11
 #define PER_SCL_PIN PB10
+#define PER_ADDRESS 0x1F
+
+#define READ_STATE 0x00
+#define READ_EVENTS 0x01
+#define READ_ATTENTION 0x02
+#define READ_IDLE_STATS 0x03
+
+#define ATTENTION_EVENT 0x01 // New button event in the queue
+#define ATTENTION_EVENTS_DROPPED 0x02 // Queue was full
+
+#define EVENT_PRESS 0x01
+#define EVENT_RELEASE 0x02
+#define EVENT_LONG_PRESS 0x03
+#define EVENT_DOUBLE_PRESS 0x04 // Follows the press event of the second press
+
+struct ButtonEvent {
+  uint8_t type;
+  uint32_t timestamp; // Milliseconds since boot
+};
 
 TwoWire WirePeripheral(PER_SDA_PIN, PER_SCL_PIN);
-HardwareSerial Serial1(PA10, PA9);
 HardwareTimer HeartbeatTimer(TIM3);
+HardwareTimer ButtonTimer(TIM2); // Debounce and long press, one-shot at 10kHz
 
+#ifdef DEBUG_LOGGING
 bool debug_mode = false;
+#else
+// Every if(debug_mode) block is compiled out, DebugLog isn't even defined
+constexpr bool debug_mode = false;
+#endif
 bool heartbeat_disable_reset_on_arrest = false;
 
-char output_byte = '0';
-bool button_state = false;
+volatile bool button_state = false; // Debounced
+volatile bool button_edge_pending = false;
+volatile uint32_t button_first_edge = 0; // Milliseconds, first edge since the button was last stable
+uint32_t button_pressed_at = 0; // Milliseconds
+uint32_t button_released_at = 0; // Milliseconds
+bool button_double_press_possible = false;
+bool button_long_press_reported = true;
 uint32_t last_heartbeat = 0;
 
+byte read_mode = READ_STATE;
+
+uint32_t idle_window_start = 0; // Milliseconds
+uint32_t idle_window_micros = 0; // Slept in the current window
+uint32_t idle_window_wakes = 0;
+uint16_t idle_permille = 0; // Of the last full window
+uint32_t idle_wakes = 0; // In the last full window
+volatile bool wake_pending = false; // Woken up, the interrupt that woke it hasn't run yet
+uint32_t wake_cycles = 0; // CPU cycles when woken up
+volatile uint32_t wake_latency = 0; // CPU cycles from waking up to the I2C callback that woke it
+volatile uint32_t wake_latency_max = 0;
+
+volatile byte attention_reasons = 0;
+byte attention_mask = 0xFF; // Reasons that pull the attention line low
+
+// Single producer (buttonTimerEvent) single consumer (requestEvent) queue, no locking needed
+ButtonEvent events[EVENT_QUEUE_SIZE];
+volatile uint8_t event_head = 0; // Written only by the producer
+volatile uint8_t event_tail = 0; // Written only by the consumer
+volatile uint32_t events_dropped = 0; // Written only by the producer
+uint32_t events_dropped_reported = 0; // Written only by the consumer
+
 void requestEvent();
 void receiveEvent(int);
 void heartbeatEvent();
+void buttonEdgeEvent();
+void buttonTimerEvent();
+void armButtonTimer(uint32_t);
+void pushEvent(uint8_t, uint32_t);
+void writeEvents();
+void writeUint32(uint32_t);
+void raiseAttention(byte);
+void updateAttentionPin();
+void writeAttention();
+void idleSleep();
+uint32_t sleepMicros();
+void recordWakeLatency();
+void writeIdleStats();
 
 void setup() {
   pinMode(ON_LED_PIN, OUTPUT);
@@ -37,11 +110,16 @@ void setup() {
   pinMode(DEBUG_SWITCH_PIN, INPUT_PULLDOWN);
   pinMode(BUTTON_PIN, INPUT);
 
+  pinMode(ATTENTION_PIN, OUTPUT_OPEN_DRAIN);
+  digitalWrite(ATTENTION_PIN, HIGH);
+
   digitalWrite(ON_LED_PIN, LOW);
   digitalWrite(ACTIVE_LED_PIN, LOW);
   digitalWrite(ERROR_LED_PIN, LOW);
 
+#ifdef DEBUG_LOGGING
   debug_mode = debug_mode || digitalRead(DEBUG_SWITCH_PIN);
+#endif
 
   if(debug_mode) {
     for(byte i = 0; i < 3; i++) {
@@ -64,19 +142,44 @@ void setup() {
   }
 
   if(debug_mode) {
-    Serial1.begin(115200);
-    Serial1.println("Start");
+    DebugLog.begin(115200);
+    DebugLog.println("Start");
   
-    Serial1.println("Debug mode enabled.");
+    DebugLog.println("Debug mode enabled.");
 
     if(heartbeat_disable_reset_on_arrest) {
-      Serial1.println("Heartbeat reset on arrest disabled.");
+      DebugLog.println("Heartbeat reset on arrest disabled.");
     } else {
-      Serial1.println("Heartbeat reset on arrest enabled.");
+      DebugLog.println("Heartbeat reset on arrest enabled.");
     }
   }
 
-  WirePeripheral.begin(0x1F);
+  button_state = digitalRead(BUTTON_PIN);
+
+  ButtonTimer.setPrescaleFactor(ButtonTimer.getTimerClkFreq() / 10000);
+  // Prescaler is only loaded on an update event, otherwise the first debounce runs at the undivided clock
+  ButtonTimer.refresh();
+  ButtonTimer.attachInterrupt(buttonTimerEvent);
+
+  attachInterrupt(BUTTON_PIN, buttonEdgeEvent, CHANGE);
+
+  // DWT cycle counter measures wake-up latency
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+#if IDLE_CLOCK_GATING
+  // Only stopped while sleeping, an interrupt starts them again
+#ifdef DEBUG_LOGGING
+  // DMA keeps sending the log from SRAM while sleeping
+  RCC->AHBENR &= ~RCC_AHBENR_FLITFEN;
+#else
+  RCC->AHBENR &= ~(RCC_AHBENR_FLITFEN | RCC_AHBENR_SRAMEN);
+#endif
+#endif
+
+  idle_window_start = millis();
+
+  WirePeripheral.begin(PER_ADDRESS);
   WirePeripheral.onRequest(requestEvent);
   WirePeripheral.onReceive(receiveEvent);
 
@@ -90,50 +193,75 @@ void setup() {
 }
 
 void loop() {
-  bool current_button_state = digitalRead(BUTTON_PIN);
+#ifdef DEBUG_LOGGING
+  DebugLog.drain();
+#endif
 
-  if(current_button_state != button_state) {
-    output_byte = current_button_state ? '1' : '0';
+  idleSleep();
+}
 
-    button_state = current_button_state;
+void requestEvent() {
+  recordWakeLatency();
 
-    if(debug_mode) {
-      Serial1.print("Button state changed to ");
-      Serial1.print(button_state ? "on" : "off");
-      Serial1.println(".");
-    }
+  if(read_mode == READ_EVENTS) {
+    read_mode = READ_STATE;
+
+    writeEvents();
+    return;
   }
-}
 
-void requestEvent() {
+  if(read_mode == READ_ATTENTION) {
+    read_mode = READ_STATE;
+
+    writeAttention();
+    return;
+  }
+
+  if(read_mode == READ_IDLE_STATS) {
+    read_mode = READ_STATE;
+
+    writeIdleStats();
+    return;
+  }
+
+  char output_byte = button_state ? '1' : '0';
+
   WirePeripheral.write(output_byte);
 
   if(debug_mode) {
-    Serial1.print("Responded to I2C request from controller with ");
-    Serial1.println(output_byte);
+    DebugLog.print("Responded to I2C request from controller with ");
+    DebugLog.println(output_byte);
   }
 }
 
 void receiveEvent(int how_many) {
+  recordWakeLatency();
+
   if(debug_mode) {
-    Serial1.print("Receiving ");
-    Serial1.print(how_many);
-    Serial1.println(" bytes from controller.");
+    DebugLog.print("Receiving ");
+    DebugLog.print(how_many);
+    DebugLog.println(" bytes from controller.");
   }
 
   char command = '\0';
+  byte value = 0; // Only command data is the attention mask
+  uint8_t data_length = 0;
 
   while(WirePeripheral.available()) {
     if(!command) {
       command = (char) WirePeripheral.read();
     } else {
-      WirePeripheral.read();
+      value = WirePeripheral.read();
+
+      if(data_length < 0xFF) {
+        data_length++;
+      }
     }
   }
 
   if(debug_mode) {
-    Serial1.print("Received command 0x");
-    Serial1.println(command, 16);
+    DebugLog.print("Received command 0x");
+    DebugLog.println(command, 16);
   }
 
   switch(command) {
@@ -144,7 +272,53 @@ void receiveEvent(int how_many) {
         last_heartbeat = millis();
 
         if(debug_mode) {
-          Serial1.println("Received heartbeat.");
+          DebugLog.println("Received heartbeat.");
+        }
+      }
+      break;
+    case 0x02: // Read events
+      {
+        read_mode = READ_EVENTS;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return button events.");
+        }
+      }
+      break;
+    case 0x03: // Read attention
+      {
+        read_mode = READ_ATTENTION;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return attention reasons.");
+        }
+      }
+      break;
+    case 0x04: // Set attention mask
+      {
+        if(data_length != 1) {
+          if(debug_mode) {
+            DebugLog.println("Attention mask has to be 1 byte long.");
+          }
+
+          break;
+        }
+
+        attention_mask = value;
+        updateAttentionPin();
+
+        if(debug_mode) {
+          DebugLog.print("Attention mask set to 0x");
+          DebugLog.println(attention_mask, 16);
+        }
+      }
+      break;
+    case 0x05: // Read idle statistics
+      {
+        read_mode = READ_IDLE_STATS;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return idle statistics.");
         }
       }
       break;
@@ -156,17 +330,284 @@ void heartbeatEvent() {
 
   if(diff > HB_TIMEOUT) {
     if(debug_mode && !heartbeat_disable_reset_on_arrest) {
-      Serial1.println("Heartbeat arrest.");
+      DebugLog.println("Heartbeat arrest.");
     }
 
     if(!heartbeat_disable_reset_on_arrest) {
       if(debug_mode) {
-        Serial1.println("Resetting...");
-        delay(50);
+        DebugLog.println("Resetting...");
+        DebugLog.flush();
       }
 
       digitalWrite(ERROR_LED_PIN, HIGH);
       HAL_NVIC_SystemReset();
     }
   }
-}
\ No newline at end of file
+}
+
+// Every edge restarts the debounce time, the level is only read once it's stable
+void buttonEdgeEvent() {
+  if(!button_edge_pending) {
+    button_first_edge = millis();
+    button_edge_pending = true;
+  }
+
+  armButtonTimer(DEBOUNCE_TIME);
+}
+
+void buttonTimerEvent() {
+  noInterrupts();
+
+  ButtonTimer.pause();
+
+  uint32_t now = millis();
+
+  if(button_edge_pending) {
+    bool level = digitalRead(BUTTON_PIN);
+    uint32_t edge = button_first_edge;
+
+    button_edge_pending = false;
+
+    if(level != button_state) {
+      button_state = level;
+
+      if(level) {
+        pushEvent(EVENT_PRESS, edge);
+
+        if(button_double_press_possible && edge - button_released_at <= DOUBLE_PRESS_TIME) {
+          pushEvent(EVENT_DOUBLE_PRESS, edge);
+          button_double_press_possible = false;
+        } else {
+          button_double_press_possible = true;
+        }
+
+        button_pressed_at = edge;
+        button_long_press_reported = false;
+      } else {
+        pushEvent(EVENT_RELEASE, edge);
+
+        button_released_at = edge;
+        button_long_press_reported = true;
+      }
+    }
+
+    // Bounce while held doesn't cancel the long press
+    if(button_state && !button_long_press_reported) {
+      uint32_t held = now - button_pressed_at;
+
+      if(held < LONG_PRESS_TIME) {
+        armButtonTimer(LONG_PRESS_TIME - held);
+      } else {
+        pushEvent(EVENT_LONG_PRESS, button_pressed_at + LONG_PRESS_TIME);
+        button_long_press_reported = true;
+      }
+    }
+  } else if(button_state && !button_long_press_reported) {
+    pushEvent(EVENT_LONG_PRESS, button_pressed_at + LONG_PRESS_TIME);
+    button_long_press_reported = true;
+
+    // A long press doesn't start a double press
+    button_double_press_possible = false;
+  }
+
+  interrupts();
+}
+
+void armButtonTimer(uint32_t milliseconds) {
+  ButtonTimer.pause();
+  ButtonTimer.setOverflow(milliseconds * 10, TICK_FORMAT);
+  ButtonTimer.setCount(0);
+  ButtonTimer.resume();
+}
+
+// Producer side, only called from buttonTimerEvent()
+void pushEvent(uint8_t type, uint32_t timestamp) {
+  uint8_t next_head = (event_head + 1) & (EVENT_QUEUE_SIZE - 1);
+
+  // Newest events are dropped when full, the host sees how many
+  if(next_head == event_tail) {
+    events_dropped++;
+    raiseAttention(ATTENTION_EVENTS_DROPPED);
+    return;
+  }
+
+  events[event_head].type = type;
+  events[event_head].timestamp = timestamp;
+
+  // Event has to be written before the consumer can see it
+  __DMB();
+  event_head = next_head;
+
+  raiseAttention(ATTENTION_EVENT);
+
+  if(debug_mode) {
+    DebugLog.print("Button event 0x");
+    DebugLog.print(type, 16);
+    DebugLog.print(" at ");
+    DebugLog.println(timestamp);
+  }
+}
+
+// Consumer side, removes only the events that fit into this response
+void writeEvents() {
+  uint8_t head = event_head;
+  uint8_t tail = event_tail;
+  uint8_t pending = (head - tail) & (EVENT_QUEUE_SIZE - 1);
+  uint8_t count = pending > EVENT_READ_MAX ? EVENT_READ_MAX : pending;
+  uint32_t dropped = events_dropped;
+  uint32_t new_dropped = dropped - events_dropped_reported;
+
+  __DMB();
+
+  writeUint32(millis());
+  WirePeripheral.write(count);
+  WirePeripheral.write((byte) (new_dropped > 0xFF ? 0xFF : new_dropped));
+
+  for(uint8_t i = 0; i < count; i++) {
+    const ButtonEvent &event = events[(tail + i) & (EVENT_QUEUE_SIZE - 1)];
+
+    WirePeripheral.write(event.type);
+    writeUint32(event.timestamp);
+  }
+
+  // Fixed length, so the controller always reads the whole response and no event is lost
+  for(uint8_t i = count; i < EVENT_READ_MAX; i++) {
+    WirePeripheral.write((byte) 0);
+    writeUint32(0);
+  }
+
+  event_tail = (tail + count) & (EVENT_QUEUE_SIZE - 1);
+  events_dropped_reported = dropped;
+
+  // Rest of the queue is left for the next read
+  if(pending > count) {
+    raiseAttention(ATTENTION_EVENT);
+  }
+
+  if(debug_mode) {
+    DebugLog.print("Responded to I2C request from controller with ");
+    DebugLog.print(count);
+    DebugLog.println(" button events.");
+  }
+}
+
+void writeUint32(uint32_t value) {
+  char value_bytes[4] = {
+    (char) (value >> 24),
+    (char) (value >> 16),
+    (char) (value >> 8),
+    (char) value
+  };
+
+  WirePeripheral.write(value_bytes, 4);
+}
+
+// Safe to call from any context, also with interrupts disabled
+void raiseAttention(byte reason) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  attention_reasons |= reason;
+  updateAttentionPin();
+
+  __set_PRIMASK(primask);
+}
+
+void updateAttentionPin() {
+  digitalWriteFast(digitalPinToPinName(ATTENTION_PIN), (attention_reasons & attention_mask) ? LOW : HIGH);
+}
+
+// Sleeps until the next interrupt, SysTick wakes it up at least every millisecond
+void idleSleep() {
+  // Interrupts are only masked, one arriving between the check and __WFI() still wakes it up
+  __disable_irq();
+
+  uint32_t sleep_start = sleepMicros();
+
+  __DSB();
+  __WFI();
+
+  idle_window_micros += sleepMicros() - sleep_start;
+  idle_window_wakes++;
+
+  wake_cycles = DWT->CYCCNT;
+  wake_pending = true;
+
+  // The interrupt that woke it up runs now
+  __enable_irq();
+
+  wake_pending = false;
+
+  uint32_t window = millis() - idle_window_start;
+
+  if(window >= IDLE_STATS_WINDOW) {
+    // Microseconds per millisecond
+    idle_permille = idle_window_micros / window > 1000 ? 1000 : idle_window_micros / window;
+    idle_wakes = idle_window_wakes;
+
+    idle_window_start += window;
+    idle_window_micros = 0;
+    idle_window_wakes = 0;
+  }
+}
+
+// micros() misses a SysTick interrupt that is pending while interrupts are masked
+uint32_t sleepMicros() {
+  uint32_t ticks = HAL_GetTick();
+  uint32_t value = SysTick->VAL;
+
+  if(SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+    ticks++;
+    value = SysTick->VAL;
+  }
+
+  uint32_t load = SysTick->LOAD + 1;
+
+  return ticks * 1000 + (load - value) * 1000 / load;
+}
+
+// Called first thing in I2C callbacks
+void recordWakeLatency() {
+  if(!wake_pending) {
+    return;
+  }
+
+  wake_pending = false;
+  wake_latency = DWT->CYCCNT - wake_cycles;
+
+  if(wake_latency > wake_latency_max) {
+    wake_latency_max = wake_latency;
+  }
+}
+
+void writeIdleStats() {
+  WirePeripheral.write((byte) (idle_permille >> 8));
+  WirePeripheral.write((byte) idle_permille);
+  writeUint32(idle_wakes);
+  writeUint32(wake_latency);
+  writeUint32(wake_latency_max);
+
+  if(debug_mode) {
+    DebugLog.println("Responded to I2C request from controller with idle statistics.");
+  }
+}
+
+// Reading the reasons clears them and releases the line
+void writeAttention() {
+  noInterrupts();
+
+  byte reasons = attention_reasons;
+
+  attention_reasons = 0;
+  updateAttentionPin();
+
+  interrupts();
+
+  WirePeripheral.write((byte) PER_ADDRESS);
+  WirePeripheral.write(reasons);
+
+  if(debug_mode) {
+    DebugLog.print("Responded to I2C request from controller with attention reasons 0x");
+    DebugLog.println(reasons, 16);
+  }
+}
@@ -1,7 +1,35 @@
 #define HB_TIMEOUT 7500 // WILL BE CHECKED 2 TIMES A SECOND
+#define IDLE_CLOCK_GATING 1 // 1 - FLASH AND SRAM (NOT WITH DEBUG_LOGGING) INTERFACE CLOCKS ARE STOPPED WHILE SLEEPING
+#define IDLE_STATS_WINDOW 1000 // MILLISECONDS IDLE TIME IS AVERAGED OVER
+#define PULSE_COUNTER_FILTER 0x0F // TIM2 ETR INPUT FILTER (0x00 - 0x0F), ONLY USED WITH HARDWARE_PULSE_COUNTER
+#define FLOW_RATE_SAMPLES 16 // NUMBER OF RECENT PULSE PERIODS KEPT FOR FLOW RATE
+#define FLOW_RATE_WINDOW 500 // MILLISECONDS OF RECENT PULSE PERIODS AVERAGED INTO FLOW RATE
+#define FLOW_RATE_TIMEOUT 2000 // FLOW RATE DROPS TO 0 AFTER NO PULSE FOR THIS MANY MILLISECONDS
+#define FLOW_RATE_DECIMATION 8 // HARDWARE_PULSE_COUNTER ONLY, TIMESTAMP EVERY N PULSES ABOVE FLOW_RATE_DECIMATION_FREQUENCY
+#define FLOW_RATE_DECIMATION_FREQUENCY 500 // HZ
+#define MAX_VOLUME_PER_PULSE 65535 // MICROLITERS, LARGER VALUES DON'T FIT 16.16 FIXED-POINT
+#define CALIBRATION_POINTS 8 // MAXIMUM NUMBER OF (PULSE FREQUENCY, VOLUME PER PULSE) POINTS
+#define CALIBRATION_POINT_TOLERANCE 10 // PERCENT, CALIBRATION AT A FREQUENCY THIS CLOSE TO AN EXISTING POINT REPLACES IT
+#define PORTION_SETTLE_TIME 1000 // MILLISECONDS WITHOUT PULSES AFTER CUT-OFF BEFORE THE POUR IS CONSIDERED FINISHED
+#define PORTION_COMPENSATION_WEIGHT 4 // OVERSHOOT COMPENSATION MOVES 1/N OF THE WAY TO THE LAST OVERSHOOT
+#define SAMPLE_BUFFER_SIZE 128 // NUMBER OF (TIMESTAMP, PULSES) SAMPLES KEPT UNTIL READ
+#define SAMPLE_BURST_SIZE 30 // MAXIMUM SAMPLES PER READ, 5 + 8 * N MUST FIT I2C_TXRX_BUFFER_SIZE
+#define SAMPLE_DECIMATION 10 // DEFAULT NUMBER OF PULSES BETWEEN SAMPLES
+#define CONFIG_FLUSH_IDLE_TIME 500 // MILLISECONDS WITHOUT PULSES BEFORE CONFIGURATION IS WRITTEN TO FLASH
+#define CONFIG_FLUSH_MAX_DELAY 5000 // MILLISECONDS AFTER WHICH CONFIGURATION IS WRITTEN EVEN DURING FLOW
+#define TOTALS_FLUSH_INTERVAL 600000 // MILLISECONDS BETWEEN SAVING TOTALS TO FLASH (IN CASE OF POWER LOSS)
+#define UNCALIBRATED_WARNING_TIME 2500 // MILLISECONDS THE LEDS SHOW THAT THE COMPONENT ISN'T CALIBRATED
+#define FOAM_STATS_SHIFT 3 // PULSE INTERVAL STATISTICS AVERAGE OVER ~2^N RECENT INTERVALS
+#define FOAM_MIN_SAMPLES 8 // INTERVALS AFTER FLOW STARTS BEFORE PULSES ARE JUDGED
+#define FOAM_CV_LIMIT 25 // PERCENT, INTERVAL STANDARD DEVIATION OVER MEAN ABOVE WHICH FLOW IS CONSIDERED FOAMY
+#define FOAM_SHORT_INTERVAL 60 // PERCENT OF MEAN AND PREVIOUS INTERVAL, A SUDDENLY SHORTER INTERVAL IS SUSPECTED AIR (TURBINE SPINNING FREELY)
+#define FOAM_MIN_JITTER 50 // PERCENT OF INTERVAL STANDARD DEVIATION, SMOOTHER CHANGES ARE A RAMP (TAP OPENING), NOT FOAM
+#define FOAM_CUTOFF_PULSES 20 // CONSECUTIVE SUSPECTED AIR PULSES THAT CUT OFF AN ARMED PORTION (IF ENABLED)
+#define BENCH_BLOCK_PULSES 256 // PULSE_BENCH ONLY, PULSES PER TIM1 UPDATE (REPETITION COUNTER + 1)
 
 #include <Arduino.h>
 #include <Wire.h>
+#include "DebugLog.h"
 #include <EEPROM.h>
 
 #define DEBUG_SWITCH_PIN PA11
@@ -11,32 +39,365 @@
 #define ERROR_LED_PIN PB14
 
 #define INPUT_PIN PB1
+#define PULSE_COUNTER_PIN PA0 // TIM2_CH1_ETR
+#define CUTOFF_PIN PB15
+#define ATTENTION_PIN PA4 // OPEN-DRAIN, ACTIVE LOW, CAN BE SHARED WITH OTHER COMPONENTS
+
+#ifdef MULTI_CHANNEL
+// Extra channels are counted by timers in external clock mode 1 (TI1FP1), without any interrupts
+#define CHANNEL_1_PIN PA8 // TIM1_CH1
+#define CHANNEL_2_PIN PB6 // TIM4_CH1
+#ifdef HARDWARE_PULSE_COUNTER
+#define EXTRA_CHANNELS 2
+#else
+#define CHANNEL_3_PIN PA0 // TIM2_CH1, only free when the primary channel uses EXTI
+#define EXTRA_CHANNELS 3
+#endif
+#else
+#define EXTRA_CHANNELS 0
+#endif
+
+#ifdef PULSE_BENCH
+#ifdef MULTI_CHANNEL
+#error "PULSE_BENCH generates pulses with TIM1 on PA8, which MULTI_CHANNEL counts channel 1 with"
+#endif
+#define BENCH_PIN PA8 // TIM1_CH1, JUMPERED TO THE INPUT PIN OF THE COUNTING MODE
+#endif
 
 #define PER_SDA_PIN PB11
 #define PER_SCL_PIN PB10
+#define PER_ADDRESS 0x2F
+
+#define READ_TOTAL_VOLUME 0x00
+#define READ_FLOW_RATE 0x01
+#define READ_CALIBRATION_TABLE 0x02
+#define READ_TOTALS 0x03
+#define READ_PORTION 0x04
+#define READ_SAMPLES 0x05
+#define READ_CONFIG_STATS 0x06
+#define READ_RECOVERY 0x07
+#define READ_FLOW_QUALITY 0x08
+#define READ_CHANNELS 0x09
+#define READ_ATTENTION 0x0A
+#define READ_IDLE_STATS 0x0B
+#define READ_BENCH 0x0C
+
+#define RECOVERY_NONE 0x00 // Cold boot, nothing recovered
+#define RECOVERY_RAM 0x01 // Warm reset, counters recovered from RAM
+#define RECOVERY_FLASH 0x02 // Power loss, totals recovered from the last save to flash
+
+// Counters in this section aren't zeroed on reset, retained_checksum tells whether they survived
+#define RETAINED __attribute__((section(".noinit")))
+#define RETAINED_MAGIC 0x52544E44 // "RTND"
+
+#define PORTION_IDLE 0x00
+#define PORTION_ARMED 0x01
+#define PORTION_REACHED 0x02 // Cut-off triggered, waiting for flow to stop
+#define PORTION_FINISHED 0x03
+#define PORTION_FOAM 0x04 // Cut off because of foam/air, not used for compensation
+
+#define FLOW_QUALITY_NONE 0x00 // No flow or not enough intervals yet
+#define FLOW_QUALITY_LIQUID 0x01
+#define FLOW_QUALITY_FOAM 0x02
+
+#define FOAM_EXCLUDE_AIR 0x01 // Suspected air pulses aren't added to total and lifetime volume
+#define FOAM_CUTOFF 0x02 // Sustained air cuts off an armed portion
+
+#define ATTENTION_VOLUME_STEP 0x01 // Total volume crossed the next multiple of the attention volume step
+#define ATTENTION_PORTION 0x02 // Portion finished or cut off because of foam
+#define ATTENTION_FOAM 0x04 // Flow turned foamy
+
+#define CALIBRATION_TABLE_ADDRESS 4
+#define CALIBRATION_TABLE_MAGIC 0x43414C31 // "CAL1"
+
+struct CalibrationPoint {
+  uint32_t pulse_frequency; // 0.1 Hz
+  uint32_t volume_per_pulse; // Microliters, 16.16 fixed-point
+};
+
+struct CalibrationTable {
+  uint32_t magic;
+  uint32_t count;
+  CalibrationPoint points[CALIBRATION_POINTS];
+};
+
+// Two flash pages right below the page used by EEPROM emulation. Records are appended to the active
+// page, when it is full the latest values are copied to the other page, which becomes active.
+#define CONFIG_PAGE_A (FLASH_END + 1 - 3 * FLASH_PAGE_SIZE)
+#define CONFIG_PAGE_B (FLASH_END + 1 - 2 * FLASH_PAGE_SIZE)
+#define CONFIG_PAGE_MAGIC 0xC0F1
+#define CONFIG_HEADER_SIZE 12
+#define CONFIG_RECORD_HEADER_SIZE 4
+#ifdef MULTI_CHANNEL
+#define CONFIG_KEYS 6
+#else
+#define CONFIG_KEYS 4
+#endif
+#define CONFIG_MAX_VALUE_SIZE sizeof(CalibrationTable)
+
+#define CONFIG_KEY_VOLUME_PER_PULSE 0x01
+#define CONFIG_KEY_CALIBRATION_TABLE 0x02
+#define CONFIG_KEY_TOTALS 0x03
+#define CONFIG_KEY_FOAM_OPTIONS 0x04
+#define CONFIG_KEY_CHANNEL_VOLUME_PER_PULSE 0x05
+#define CONFIG_KEY_CHANNEL_TOTALS 0x06
+
+// Page header, magic is programmed last so a page is only valid once fully written
+struct ConfigPageHeader {
+  uint32_t generation;
+  uint32_t erase_count;
+  uint16_t crc;
+  uint16_t magic;
+};
+
+struct SavedTotals {
+  uint64_t total_volume;
+  uint64_t lifetime_volume;
+};
+
+#ifdef MULTI_CHANNEL
+struct PulseChannel {
+  uint64_t total_volume; // Microliters, 48.16 fixed-point, since last reset
+  uint64_t lifetime_volume; // Microliters, 48.16 fixed-point
+  uint32_t pulse_count;
+  uint32_t calibration_mode;
+  uint32_t calibration_counter;
+  uint32_t reserved; // Keeps the size a multiple of 8 bytes
+};
+#endif
+
+struct ConfigEntry {
+  uint8_t length; // 0 if not set
+  bool dirty;
+  uint8_t data[CONFIG_MAX_VALUE_SIZE];
+};
+
+struct PulseSample {
+  uint32_t timestamp; // Microseconds
+  uint32_t pulses; // Cumulative since boot
+};
 
 TwoWire WirePeripheral(PER_SDA_PIN, PER_SCL_PIN);
-HardwareSerial Serial1(PA10, PA9);
 HardwareTimer HeartbeatTimer(TIM3);
-
+#ifdef HARDWARE_PULSE_COUNTER
+HardwareTimer PulseCounterTimer(TIM2);
+#endif
+#ifdef MULTI_CHANNEL
+HardwareTimer Channel1Timer(TIM1);
+HardwareTimer Channel2Timer(TIM4);
+#ifndef HARDWARE_PULSE_COUNTER
+HardwareTimer Channel3Timer(TIM2);
+#endif
+#endif
+#ifdef PULSE_BENCH
+HardwareTimer BenchTimer(TIM1);
+#endif
+
+#ifdef DEBUG_LOGGING
 bool debug_mode = false;
+#else
+// Every if(debug_mode) block is compiled out, DebugLog isn't even defined
+constexpr bool debug_mode = false;
+#endif
 bool heartbeat_disable_reset_on_arrest = false;
-bool calibration_mode = false;
+uint32_t calibration_mode RETAINED;
 
 uint32_t volume_per_pulse = 0;
 
-char output_buffer[4] = { 0, 0, 0, 0 };
 uint32_t last_heartbeat = 0;
 
-uint32_t total_volume = 0;
-uint32_t calibration_counter = 0;
+// Microliters, 48.16 fixed-point. Doesn't wrap for 281 million liters.
+uint64_t total_volume RETAINED; // Since last reset
+uint64_t lifetime_volume RETAINED;
+uint32_t calibration_counter RETAINED;
+
+CalibrationTable calibration_table;
+int64_t calibration_slopes[CALIBRATION_POINTS]; // Volume per pulse change per 0.1 Hz, 32.32 fixed-point
+volatile uint32_t last_pulse_frequency = 0; // 0.1 Hz, 0 if unknown
+bool calibration_timed = false;
+uint32_t calibration_first_pulse_millis = 0;
+uint32_t calibration_timed_pulses = 0;
+
+byte read_mode = READ_TOTAL_VOLUME;
+
+volatile bool loop_work_pending = false; // Set by interrupts that leave work for loop()
+uint32_t idle_window_start = 0; // Milliseconds
+uint32_t idle_window_micros = 0; // Slept in the current window
+uint32_t idle_window_wakes = 0;
+uint16_t idle_permille = 0; // Of the last full window
+uint32_t idle_wakes = 0; // In the last full window
+volatile bool wake_pending = false; // Woken up, the interrupt that woke it hasn't run yet
+uint32_t wake_cycles = 0; // CPU cycles when woken up
+volatile uint32_t wake_latency = 0; // CPU cycles from waking up to the I2C callback that woke it
+volatile uint32_t wake_latency_max = 0;
+
+volatile byte attention_reasons = 0;
+byte attention_mask = 0xFF; // Reasons that pull the attention line low
+uint32_t attention_volume_step = 0; // Microliters, 0 if disabled
+uint64_t attention_next_volume = 0; // Total volume at which ATTENTION_VOLUME_STEP is raised next, 48.16 fixed-point
+
+volatile byte portion_state = PORTION_IDLE;
+uint32_t portion_size = 0; // Microliters
+uint64_t portion_start_volume = 0; // Lifetime volume when armed, 48.16 fixed-point
+uint64_t portion_cutoff_volume = 0; // Lifetime volume at which cut-off triggers, 48.16 fixed-point
+uint64_t portion_reached_volume = 0; // Lifetime volume when cut-off triggered, 48.16 fixed-point
+uint32_t portion_compensation = 0; // Microliters still flowing after cut-off, learned from recent pours
+int32_t portion_overshoot = 0; // Microliters over (or under) portion size of the last finished pour
+
+uint32_t pulse_count RETAINED;
+uint32_t retained_checksum RETAINED;
+
+byte recovery_status = RECOVERY_NONE;
+byte reset_flags = 0;
+SavedTotals recovered_totals = { 0, 0 };
+uint64_t saved_lifetime_volume = 0;
+uint32_t last_totals_save = 0;
+uint32_t uncalibrated_warning_start = 0;
+bool uncalibrated_warning = false;
+
+PulseSample samples[SAMPLE_BUFFER_SIZE];
+volatile uint16_t sample_head = 0; // Next sample to write
+volatile uint16_t sample_count = 0;
+volatile uint32_t sample_sequence = 0; // Sequence number of the next sample
+uint16_t sample_decimation = SAMPLE_DECIMATION;
+uint32_t last_sample_pulses = 0;
+
+ConfigEntry config_entries[CONFIG_KEYS];
+volatile bool config_pending = false;
+volatile uint32_t config_pending_since = 0;
+uint32_t config_active_page = 0; // 0 if no valid page
+uint32_t config_generation = 0;
+uint32_t config_free_offset = 0;
+uint32_t config_erase_counts[2] = { 0, 0 };
+uint32_t config_commits = 0;
+uint32_t config_last_commit_latency = 0; // Microseconds
+uint32_t config_max_commit_latency = 0; // Microseconds
+
+uint32_t flow_rate_periods[FLOW_RATE_SAMPLES]; // CPU cycles
+uint8_t flow_rate_pulses[FLOW_RATE_SAMPLES]; // Pulses counted within each period
+volatile uint8_t flow_rate_head = 0;
+volatile uint8_t flow_rate_count = 0;
+volatile bool flow_rate_timestamped = false;
+volatile uint32_t last_pulse_cycles = 0;
+volatile uint32_t last_pulse_millis = 0;
+
+// Statistics of the interval per pulse, exponentially weighted so they follow the flow rate
+volatile byte flow_quality = FLOW_QUALITY_NONE;
+uint32_t interval_mean = 0; // CPU cycles
+uint64_t interval_variance = 0; // CPU cycles squared
+uint32_t interval_jitter = 0; // CPU cycles, mean difference between consecutive intervals
+uint32_t last_interval = 0;
+uint16_t interval_samples = 0; // Since flow started, saturates at FOAM_MIN_SAMPLES
+volatile bool air_suspected = false;
+bool short_burst = false; // Intervals stayed short since a sudden jump
+volatile uint16_t air_run = 0; // Consecutive suspected air pulses
+byte foam_options = 0;
+uint32_t air_pulses = 0;
+uint64_t air_volume = 0; // Microliters, 48.16 fixed-point
+
+#ifdef MULTI_CHANNEL
+HardwareTimer *channel_timers[EXTRA_CHANNELS] = {
+  &Channel1Timer,
+  &Channel2Timer,
+#ifndef HARDWARE_PULSE_COUNTER
+  &Channel3Timer,
+#endif
+};
+const uint32_t channel_pins[EXTRA_CHANNELS] = {
+  CHANNEL_1_PIN,
+  CHANNEL_2_PIN,
+#ifndef HARDWARE_PULSE_COUNTER
+  CHANNEL_3_PIN,
+#endif
+};
+PulseChannel channels[EXTRA_CHANNELS] RETAINED; // Index 0 is channel 1
+uint32_t channels_checksum RETAINED;
+uint32_t channel_volume_per_pulse[EXTRA_CHANNELS]; // Microliters, 16.16 fixed-point
+uint16_t channel_last_counts[EXTRA_CHANNELS];
+uint64_t saved_channels_lifetime_volume = 0;
+#endif
+
+#ifdef PULSE_BENCH
+volatile bool bench_running = false;
+volatile uint32_t bench_blocks_left = 0;
+volatile uint32_t bench_generated = 0; // Pulses
+uint32_t bench_frequency = 0; // Hz, as the timer could be set up
+uint32_t bench_start_pulses = 0; // pulse_count when the run started
+#endif
+
+#ifdef HARDWARE_PULSE_COUNTER
+volatile uint32_t pulse_counter_overflows = 0;
+uint32_t synced_pulses = 0;
+uint16_t pulse_counter_last_compare = 0;
+#endif
 
 void clearTotalVolume();
 void updateVolumePerPulse(uint32_t);
+void loadCalibrationTable();
+void addCalibrationPoint(uint32_t, uint32_t);
+void updateCalibrationTable(CalibrationTable&);
+void applyCalibrationTable(CalibrationTable&);
+uint32_t volumePerPulseAt(uint32_t);
+void addVolume(uint32_t, uint32_t);
 void requestEvent();
 void receiveEvent(int);
 void inputInterruptHandler();
 void heartbeatEvent();
+uint32_t recordPulses(uint8_t);
+uint32_t getFlowRate();
+void updateFlowQuality(uint32_t, uint8_t);
+void writeFlowQuality();
+uint32_t squareRoot(uint64_t);
+void writeUint32(uint32_t);
+void writeUint64(uint64_t);
+uint32_t readUint32(const char*);
+void recordSample();
+void writeSamples();
+void configInit();
+bool configGet(uint8_t, void*, uint8_t);
+void configSet(uint8_t, const void*, uint8_t);
+void configFlush();
+bool configAppend(uint8_t, const uint8_t*, uint8_t);
+bool configRotate();
+bool configProgram(uint32_t, const uint8_t*, uint32_t);
+bool configReadHeader(uint32_t, ConfigPageHeader&);
+uint32_t configScanPage(uint32_t, bool);
+uint16_t crc16(const uint8_t*, uint32_t, uint16_t);
+void restoreCounters();
+void retainCounters();
+uint32_t retainedChecksum();
+void saveTotals();
+void armPortion(uint32_t);
+void cancelPortion();
+void finishPortion();
+void writeChannels();
+void raiseAttention(byte);
+void updateAttentionPin();
+void writeAttention();
+void idleSleep();
+uint32_t sleepMicros();
+void recordWakeLatency();
+void writeIdleStats();
+void setAttentionVolumeStep(uint32_t);
+#ifdef MULTI_CHANNEL
+void setupChannels();
+void syncChannels();
+void restoreChannels();
+uint32_t channelsChecksum();
+void saveChannelTotals();
+#endif
+#ifdef PULSE_BENCH
+void startBench(uint32_t, uint16_t);
+void benchUpdateEvent();
+void writeBench();
+#endif
+#ifdef HARDWARE_PULSE_COUNTER
+void setupPulseCounter();
+uint32_t readPulseCounter();
+void syncPulseCounter();
+void pulseCounterOverflowEvent();
+void pulseCounterCompareEvent();
+#endif
 
 void setup() {
   pinMode(ON_LED_PIN, OUTPUT);
@@ -44,15 +405,32 @@ void setup() {
   pinMode(ERROR_LED_PIN, OUTPUT);
   
   pinMode(DEBUG_SWITCH_PIN, INPUT_PULLDOWN);
+  pinMode(CUTOFF_PIN, OUTPUT);
+
+  pinMode(ATTENTION_PIN, OUTPUT_OPEN_DRAIN);
+  digitalWrite(ATTENTION_PIN, HIGH);
+#ifdef HARDWARE_PULSE_COUNTER
+  pinMode(PULSE_COUNTER_PIN, INPUT_PULLUP);
+#else
   pinMode(INPUT_PIN, INPUT_PULLUP);
+#endif
 
   digitalWrite(ON_LED_PIN, LOW);
   digitalWrite(ACTIVE_LED_PIN, LOW);
   digitalWrite(ERROR_LED_PIN, LOW);
+  digitalWrite(CUTOFF_PIN, LOW);
 
-  attachInterrupt(INPUT_PIN, inputInterruptHandler, RISING);
+  // DWT cycle counter is used to timestamp pulses for flow rate
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+  reset_flags = RCC->CSR >> 24;
+  __HAL_RCC_CLEAR_RESET_FLAGS();
 
+#ifdef DEBUG_LOGGING
   debug_mode = debug_mode || digitalRead(DEBUG_SWITCH_PIN);
+#endif
 
   if(debug_mode) {
     for(byte i = 0; i < 3; i++) {
@@ -75,41 +453,88 @@ void setup() {
   }
 
   if(debug_mode) {
-    Serial1.begin(115200);
-    Serial1.println("Start");
+    DebugLog.begin(115200);
+    DebugLog.println("Start");
 
-    Serial1.println("Debug mode enabled.");
+    DebugLog.println("Debug mode enabled.");
 
     if(heartbeat_disable_reset_on_arrest) {
-      Serial1.println("Heartbeat reset on arrest disabled.");
+      DebugLog.println("Heartbeat reset on arrest disabled.");
     } else {
-      Serial1.println("Heartbeat reset on arrest enabled.");
+      DebugLog.println("Heartbeat reset on arrest enabled.");
     }
+
+#ifdef HARDWARE_PULSE_COUNTER
+    DebugLog.println("Counting pulses in hardware (TIM2 ETR).");
+#else
+    DebugLog.println("Counting pulses with EXTI interrupt.");
+#endif
   }
 
-  EEPROM.get(0, volume_per_pulse);
+  configInit();
+
+  if(!configGet(CONFIG_KEY_VOLUME_PER_PULSE, &volume_per_pulse, sizeof(volume_per_pulse))) {
+    // Migrate value stored by firmware using EEPROM
+    EEPROM.get(0, volume_per_pulse);
+
+    if(volume_per_pulse != 0 && volume_per_pulse <= MAX_VOLUME_PER_PULSE) {
+      configSet(CONFIG_KEY_VOLUME_PER_PULSE, &volume_per_pulse, sizeof(volume_per_pulse));
+    }
+  }
 
   if(debug_mode) {
-    Serial1.print("Read volume per pulse from EEPROM: ");
-    Serial1.println(volume_per_pulse);
+    DebugLog.print("Read volume per pulse from configuration: ");
+    DebugLog.println(volume_per_pulse);
   }
 
-  if(volume_per_pulse == 0 || volume_per_pulse == 0xFFFFFFFF) {
+  if(volume_per_pulse == 0 || volume_per_pulse > MAX_VOLUME_PER_PULSE) {
+    // LEDs are turned off from loop() so that booting isn't delayed
     digitalWrite(ERROR_LED_PIN, HIGH);
     digitalWrite(ACTIVE_LED_PIN, HIGH);
 
+    uncalibrated_warning = true;
+    uncalibrated_warning_start = millis();
+
     volume_per_pulse = 170;
 
     if(debug_mode) {
-      Serial1.println("Component not calibrated. Using default value for volume per pulse (170).");
+      DebugLog.println("Component not calibrated. Using default value for volume per pulse (170).");
     }
-
-    delay(2500);
-    digitalWrite(ERROR_LED_PIN, LOW);
-    digitalWrite(ACTIVE_LED_PIN, LOW);
   }
 
-  WirePeripheral.begin(0x2F);
+  loadCalibrationTable();
+  restoreCounters();
+
+  configGet(CONFIG_KEY_FOAM_OPTIONS, &foam_options, sizeof(foam_options));
+
+#ifdef MULTI_CHANNEL
+  restoreChannels();
+  setupChannels();
+#endif
+
+  // Pulses are only counted once volume per pulse is known
+#ifdef HARDWARE_PULSE_COUNTER
+  setupPulseCounter();
+#else
+  attachInterrupt(INPUT_PIN, inputInterruptHandler, RISING);
+#endif
+
+  // Keeps the DWT cycle counter (pulse timestamps) running while sleeping
+  DBGMCU->CR |= DBGMCU_CR_DBG_SLEEP;
+
+#if IDLE_CLOCK_GATING
+  // Only stopped while sleeping, an interrupt starts them again
+#ifdef DEBUG_LOGGING
+  // DMA keeps sending the log from SRAM while sleeping
+  RCC->AHBENR &= ~RCC_AHBENR_FLITFEN;
+#else
+  RCC->AHBENR &= ~(RCC_AHBENR_FLITFEN | RCC_AHBENR_SRAMEN);
+#endif
+#endif
+
+  idle_window_start = millis();
+
+  WirePeripheral.begin(PER_ADDRESS);
   WirePeripheral.onRequest(requestEvent);
   WirePeripheral.onReceive(receiveEvent);
 
@@ -123,246 +548,2297 @@ void setup() {
 }
 
 void loop() {
+#ifdef MULTI_CHANNEL
+  // 16-bit channel counters can't wrap between two loop iterations at any sensor's pulse rate
+  syncChannels();
+#endif
+
+  if(uncalibrated_warning && millis() - uncalibrated_warning_start > UNCALIBRATED_WARNING_TIME) {
+    uncalibrated_warning = false;
+
+    digitalWrite(ERROR_LED_PIN, LOW);
+    digitalWrite(ACTIVE_LED_PIN, calibration_mode || portion_state == PORTION_ARMED ? HIGH : LOW);
+  }
+
+  if(millis() - last_totals_save > TOTALS_FLUSH_INTERVAL) {
+    saveTotals();
+#ifdef MULTI_CHANNEL
+    saveChannelTotals();
+#endif
+  }
+
+  if(portion_state == PORTION_REACHED && millis() - last_pulse_millis > PORTION_SETTLE_TIME) {
+    finishPortion();
+  }
+
+  // Flash writes stall the CPU, so they wait until the flow stops (or for too long)
+  if(
+    config_pending && (
+      millis() - last_pulse_millis > CONFIG_FLUSH_IDLE_TIME ||
+      millis() - config_pending_since > CONFIG_FLUSH_MAX_DELAY
+    )
+  ) {
+    configFlush();
+  }
+
+#ifdef DEBUG_LOGGING
+  DebugLog.drain();
+#endif
+
+  idleSleep();
 }
 
 void clearTotalVolume() {
-  total_volume = 0;
+#ifdef HARDWARE_PULSE_COUNTER
+  syncPulseCounter();
+#endif
 
-  output_buffer[0] = 0;
-  output_buffer[1] = 0;
-  output_buffer[2] = 0;
-  output_buffer[3] = 0;
+  noInterrupts();
+  total_volume = 0;
+  attention_next_volume = (uint64_t) attention_volume_step << 16;
+  retainCounters();
+  interrupts();
 }
 
 void updateVolumePerPulse(uint32_t new_volume_per_pulse) {
+#ifdef HARDWARE_PULSE_COUNTER
+  // Pulses counted so far still have to use the old value
+  syncPulseCounter();
+#endif
+
   volume_per_pulse = new_volume_per_pulse;
-  EEPROM.put(0, new_volume_per_pulse);
+  configSet(CONFIG_KEY_VOLUME_PER_PULSE, &volume_per_pulse, sizeof(volume_per_pulse));
+
+  // A fixed volume per pulse replaces the whole calibration curve
+  CalibrationTable new_calibration_table;
+
+  new_calibration_table.magic = CALIBRATION_TABLE_MAGIC;
+  new_calibration_table.count = 1;
+  new_calibration_table.points[0].pulse_frequency = 0;
+  new_calibration_table.points[0].volume_per_pulse = new_volume_per_pulse << 16;
+
+  updateCalibrationTable(new_calibration_table);
 
   if(debug_mode) {
-    Serial1.print("Saved volume per pulse to EEPROM: ");
-    Serial1.println(volume_per_pulse);
+    DebugLog.print("Queued volume per pulse for saving: ");
+    DebugLog.println(volume_per_pulse);
   }
 }
 
-void requestEvent() {
-  WirePeripheral.write(output_buffer, 4);
+void loadCalibrationTable() {
+  CalibrationTable stored_calibration_table;
 
-  if(debug_mode) {
-    Serial1.print("Responded to I2C request from controller with value ");
-    Serial1.println(total_volume);
+  if(!configGet(CONFIG_KEY_CALIBRATION_TABLE, &stored_calibration_table, sizeof(stored_calibration_table))) {
+    // Migrate table stored by firmware using EEPROM
+    EEPROM.get(CALIBRATION_TABLE_ADDRESS, stored_calibration_table);
   }
+
+  if(
+    stored_calibration_table.magic != CALIBRATION_TABLE_MAGIC ||
+    stored_calibration_table.count == 0 ||
+    stored_calibration_table.count > CALIBRATION_POINTS
+  ) {
+    // Calibrated before calibration curves existed, use the single volume per pulse
+    stored_calibration_table.magic = CALIBRATION_TABLE_MAGIC;
+    stored_calibration_table.count = 1;
+    stored_calibration_table.points[0].pulse_frequency = 0;
+    stored_calibration_table.points[0].volume_per_pulse = volume_per_pulse << 16;
+  }
+
+  applyCalibrationTable(stored_calibration_table);
 }
 
-void receiveEvent(int how_many) {
+void updateCalibrationTable(CalibrationTable &new_calibration_table) {
+  configSet(CONFIG_KEY_CALIBRATION_TABLE, &new_calibration_table, sizeof(new_calibration_table));
+
+  applyCalibrationTable(new_calibration_table);
+}
+
+void applyCalibrationTable(CalibrationTable &new_calibration_table) {
+  int64_t new_calibration_slopes[CALIBRATION_POINTS] = {};
+
+  // Slopes are precalculated so that interpolating in the pulse path doesn't need a division
+  for(uint32_t i = 0; i + 1 < new_calibration_table.count; i++) {
+    CalibrationPoint &low = new_calibration_table.points[i];
+    CalibrationPoint &high = new_calibration_table.points[i + 1];
+
+    new_calibration_slopes[i] =
+      ((int64_t) high.volume_per_pulse - (int64_t) low.volume_per_pulse) * 65536 /
+      (int64_t) (high.pulse_frequency - low.pulse_frequency);
+  }
+
+  noInterrupts();
+
+  calibration_table = new_calibration_table;
+  memcpy(calibration_slopes, new_calibration_slopes, sizeof(calibration_slopes));
+
+  interrupts();
+
   if(debug_mode) {
-    Serial1.print("Receiving ");
-    Serial1.print(how_many);
-    Serial1.println(" bytes from controller.");
+    DebugLog.print("Using calibration curve with ");
+    DebugLog.print(calibration_table.count);
+    DebugLog.println(" points:");
+
+    for(uint32_t i = 0; i < calibration_table.count; i++) {
+      DebugLog.print("  ");
+      DebugLog.print(calibration_table.points[i].pulse_frequency / 10);
+      DebugLog.print(".");
+      DebugLog.print(calibration_table.points[i].pulse_frequency % 10);
+      DebugLog.print(" Hz -> ");
+      DebugLog.print(calibration_table.points[i].volume_per_pulse >> 16);
+      DebugLog.print(" + ");
+      DebugLog.print(calibration_table.points[i].volume_per_pulse & 0xFFFF);
+      DebugLog.println("/65536 uL per pulse");
+    }
   }
+}
 
-  char command = '\0';
-  String data = "";
+void addCalibrationPoint(uint32_t pulse_frequency, uint32_t new_volume_per_pulse) {
+  CalibrationTable new_calibration_table = calibration_table;
+  CalibrationPoint *points = new_calibration_table.points;
+  uint32_t count = new_calibration_table.count;
 
-  while(WirePeripheral.available()) {
-    if(!command) {
-      command = (char) WirePeripheral.read();
-    } else {
-      data += (char) WirePeripheral.read();
+  // Point set through 0x03 (or defaults) doesn't have a frequency and is replaced by the first calibration
+  if(count == 1 && points[0].pulse_frequency == 0) {
+    count = 0;
+  }
+
+  uint32_t nearest = 0;
+  uint32_t nearest_distance = 0xFFFFFFFF;
+
+  for(uint32_t i = 0; i < count; i++) {
+    uint32_t distance = points[i].pulse_frequency > pulse_frequency ?
+      points[i].pulse_frequency - pulse_frequency :
+      pulse_frequency - points[i].pulse_frequency;
+
+    if(distance < nearest_distance) {
+      nearest = i;
+      nearest_distance = distance;
     }
   }
 
-  if(debug_mode) {
-    Serial1.print("Received command 0x");
-    Serial1.println(command, 16);
+  bool replace_nearest =
+    count == CALIBRATION_POINTS ||
+    (count > 0 && (uint64_t) nearest_distance * 100 <= (uint64_t) pulse_frequency * CALIBRATION_POINT_TOLERANCE);
+
+  if(replace_nearest) {
+    for(uint32_t i = nearest; i + 1 < count; i++) {
+      points[i] = points[i + 1];
+    }
+
+    count--;
   }
 
-  switch(command) {
-    case 0x00:
-      break;
-    case 0x01: // Receive heartbeat
-      {
-        last_heartbeat = millis();
+  uint32_t index = count;
 
-        if(debug_mode) {
-          Serial1.println("Received heartbeat.");
-        }
-      }
-      break;
-    case 0x02: // Reset total volume
-      {
-        digitalWrite(ERROR_LED_PIN, LOW);
+  while(index > 0 && points[index - 1].pulse_frequency > pulse_frequency) {
+    points[index] = points[index - 1];
+    index--;
+  }
 
-        clearTotalVolume();
+  points[index].pulse_frequency = pulse_frequency;
+  points[index].volume_per_pulse = new_volume_per_pulse;
 
-        if(debug_mode) {
-          Serial1.println("Reset total volume to 0.");
-        }
-      }
-      break;
-    case 0x03: // Set volume per pulse
-      {
-        if(data.length() != 4) {
-          if(debug_mode) {
-            Serial1.println("Received invalid data for setting volume per pulse.");
-          }
+  new_calibration_table.count = count + 1;
 
-          digitalWrite(ERROR_LED_PIN, HIGH);
-          break;
-        }
+  updateCalibrationTable(new_calibration_table);
+}
 
-        uint32_t new_volume_per_pulse = 0;
-        const char* data_bytes = data.c_str();
+uint32_t volumePerPulseAt(uint32_t pulse_frequency) {
+  const CalibrationPoint *points = calibration_table.points;
+  uint32_t last = calibration_table.count - 1;
 
-        new_volume_per_pulse |= data_bytes[0] << 24;
-        new_volume_per_pulse |= data_bytes[1] << 16;
-        new_volume_per_pulse |= data_bytes[2] << 8;
-        new_volume_per_pulse |= data_bytes[3];
+  if(pulse_frequency <= points[0].pulse_frequency) {
+    return points[0].volume_per_pulse;
+  }
 
-        if(debug_mode) {
-          Serial1.print("Received new volume per pulse: ");
-          Serial1.println(new_volume_per_pulse);
-        }
+  if(pulse_frequency >= points[last].pulse_frequency) {
+    return points[last].volume_per_pulse;
+  }
 
-        updateVolumePerPulse(new_volume_per_pulse);
-      }
-      break;
-    case 0x04: // Enter calibration mode
-      {
-        digitalWrite(ERROR_LED_PIN, HIGH);
-        digitalWrite(ACTIVE_LED_PIN, HIGH);
+  uint32_t i = 0;
 
-        if(!calibration_mode) {
-          calibration_mode = true;
-          calibration_counter = 0;
-          
-          clearTotalVolume();
+  while(pulse_frequency >= points[i + 1].pulse_frequency) {
+    i++;
+  }
 
-          if(debug_mode) {
-            Serial1.println("Entered calibration mode.");
-          }
-        } else {
-          if(debug_mode) {
-            Serial1.println("Already in calibration mode.");
-          }
-        }
-      }
-      break;
-    case 0x05: // Finish calibration
-      {
-        if(calibration_mode) {
-          digitalWrite(ERROR_LED_PIN, LOW);
-          digitalWrite(ACTIVE_LED_PIN, LOW);
+  int64_t offset = calibration_slopes[i] * (int32_t) (pulse_frequency - points[i].pulse_frequency);
 
-          if(data.length() != 4) {
-            if(debug_mode) {
-              Serial1.println("Received invalid data for calibration.");
-            }
-          } else {
-            uint32_t volume_calibration_input = 0;
-            const char* data_bytes = data.c_str();
+  return (uint32_t) ((int64_t) points[i].volume_per_pulse + (offset >> 16));
+}
 
-            volume_calibration_input |= data_bytes[0] << 24;
-            volume_calibration_input |= data_bytes[1] << 16;
-            volume_calibration_input |= data_bytes[2] << 8;
-            volume_calibration_input |= data_bytes[3];
+// Called from the pulse path, must not use floating point
+void addVolume(uint32_t pulses, uint32_t pulse_frequency) {
+  uint64_t volume = (uint64_t) pulses * volumePerPulseAt(pulse_frequency);
 
-            uint32_t new_volume_per_pulse = ceil((double) volume_calibration_input / (double) calibration_counter);
+  if(air_suspected) {
+    air_pulses += pulses;
+    air_volume += volume;
 
-            if(debug_mode) {
-              Serial1.print("Calculated new volume per pulse: ");
-              Serial1.println(new_volume_per_pulse);
-            }
+    if(foam_options & FOAM_EXCLUDE_AIR) {
+      volume = 0;
+    }
+  }
 
-            updateVolumePerPulse(new_volume_per_pulse);
+  total_volume += volume;
+  lifetime_volume += volume;
+  pulse_count += pulses;
 
-            calibration_mode = false;
-            calibration_counter = 0;
+  if(attention_volume_step > 0 && total_volume >= attention_next_volume) {
+    raiseAttention(ATTENTION_VOLUME_STEP);
 
-            clearTotalVolume();
+    // No division in the pulse path, one pulse rarely crosses more than one step
+    while(attention_next_volume <= total_volume) {
+      attention_next_volume += (uint64_t) attention_volume_step << 16;
+    }
+  }
 
-            if(debug_mode) {
-              Serial1.println("Finished calibration.");
-            }
-          }
-        } else {
-          digitalWrite(ERROR_LED_PIN, HIGH);
+  if(calibration_mode) {
+    calibration_counter += pulses;
+  }
 
-          if(debug_mode) {
-            Serial1.println("Received finish calibration command, but not in calibration mode.");
-          }
-        }
-      }
-      break;
-    case 0x06: // Cancel calibration
-      {
-        if(calibration_mode) {
-          digitalWrite(ERROR_LED_PIN, LOW);
-          digitalWrite(ACTIVE_LED_PIN, LOW);
+  retainCounters();
 
-          calibration_mode = false;
-          calibration_counter = 0;
-          
-          clearTotalVolume();
+  if(sample_decimation > 0 && pulse_count - last_sample_pulses >= sample_decimation) {
+    recordSample();
+  }
 
-          if(debug_mode) {
-            Serial1.println("Cancelled calibration.");
-          }
-        } else {
-          digitalWrite(ERROR_LED_PIN, HIGH);
+  if(portion_state == PORTION_ARMED && lifetime_volume >= portion_cutoff_volume) {
+    digitalWriteFast(digitalPinToPinName(CUTOFF_PIN), HIGH);
 
-          if(debug_mode) {
-            Serial1.println("Received cancel calibration command, but not in calibration mode.");
-          }
-        }
-      }
-      break;
-    default:
-      {
-        digitalWrite(ERROR_LED_PIN, HIGH);
+    portion_state = PORTION_REACHED;
+    portion_reached_volume = lifetime_volume;
+  }
 
-        if(debug_mode) {
-          Serial1.print("Unknown command 0x");
-          Serial1.println(command, 16);
-        }
-      }
+  // Empty keg, no point in waiting for the portion
+  if(portion_state == PORTION_ARMED && (foam_options & FOAM_CUTOFF) && air_run >= FOAM_CUTOFF_PULSES) {
+    digitalWriteFast(digitalPinToPinName(CUTOFF_PIN), HIGH);
+
+    portion_state = PORTION_FOAM;
+    raiseAttention(ATTENTION_PORTION);
   }
 }
 
-void inputInterruptHandler() {
-  total_volume += volume_per_pulse;
+void recordSample() {
+  PulseSample &sample = samples[sample_head];
 
-  if(calibration_mode) {
-    calibration_counter++;
+  sample.timestamp = micros();
+  sample.pulses = pulse_count;
+
+  sample_head = (sample_head + 1) % SAMPLE_BUFFER_SIZE;
+  sample_sequence++;
+
+  // When full the oldest sample is dropped, the host sees a gap in sequence numbers
+  if(sample_count < SAMPLE_BUFFER_SIZE) {
+    sample_count++;
   }
 
-  digitalWrite(ACTIVE_LED_PIN, HIGH);
+  last_sample_pulses = pulse_count;
+}
 
-  unsigned char *total_volume_bytes = (unsigned char *)&total_volume;
+void writeSamples() {
+  PulseSample burst[SAMPLE_BURST_SIZE];
 
-  output_buffer[0] = total_volume_bytes[3];
-  output_buffer[1] = total_volume_bytes[2];
-  output_buffer[2] = total_volume_bytes[1];
-  output_buffer[3] = total_volume_bytes[0];
+  noInterrupts();
 
-  digitalWrite(ACTIVE_LED_PIN, LOW);
+  uint16_t burst_count = sample_count < SAMPLE_BURST_SIZE ? sample_count : SAMPLE_BURST_SIZE;
+  uint16_t tail = (sample_head + SAMPLE_BUFFER_SIZE - sample_count) % SAMPLE_BUFFER_SIZE;
+  uint32_t first_sequence = sample_sequence - sample_count;
+
+  for(uint16_t i = 0; i < burst_count; i++) {
+    burst[i] = samples[(tail + i) % SAMPLE_BUFFER_SIZE];
+  }
+
+  sample_count -= burst_count;
+
+  interrupts();
+
+  writeUint32(first_sequence);
+  WirePeripheral.write((uint8_t) burst_count);
+
+  for(uint16_t i = 0; i < SAMPLE_BURST_SIZE; i++) {
+    if(i < burst_count) {
+      writeUint32(burst[i].timestamp);
+      writeUint32(burst[i].pulses);
+    } else {
+      writeUint32(0);
+      writeUint32(0);
+    }
+  }
+
+  if(debug_mode) {
+    DebugLog.print("Responded to I2C request from controller with ");
+    DebugLog.print(burst_count);
+    DebugLog.print(" samples starting at ");
+    DebugLog.println(first_sequence);
+  }
 }
 
-void heartbeatEvent() {
-  uint32_t diff = millis() - last_heartbeat;
+void configInit() {
+  ConfigPageHeader header_a;
+  ConfigPageHeader header_b;
+
+  bool valid_a = configReadHeader(CONFIG_PAGE_A, header_a);
+  bool valid_b = configReadHeader(CONFIG_PAGE_B, header_b);
+
+  // Erase count survives in an invalid header if the page was erased but never finished
+  config_erase_counts[0] = header_a.erase_count != 0xFFFFFFFF ? header_a.erase_count : 0;
+  config_erase_counts[1] = header_b.erase_count != 0xFFFFFFFF ? header_b.erase_count : 0;
+
+  if(valid_a && (!valid_b || header_a.generation > header_b.generation)) {
+    config_active_page = CONFIG_PAGE_A;
+    config_generation = header_a.generation;
+  } else if(valid_b) {
+    config_active_page = CONFIG_PAGE_B;
+    config_generation = header_b.generation;
+  } else {
+    config_active_page = 0;
+    config_generation = 0;
+  }
 
-  if(diff > HB_TIMEOUT) {
-    if(debug_mode && !heartbeat_disable_reset_on_arrest) {
-      Serial1.println("Heartbeat arrest.");
+  if(config_active_page) {
+    config_free_offset = configScanPage(config_active_page, true);
+  } else {
+    config_free_offset = FLASH_PAGE_SIZE;
+  }
+
+  if(debug_mode) {
+    DebugLog.print("Configuration store generation ");
+    DebugLog.print(config_generation);
+    DebugLog.print(", ");
+    DebugLog.print(FLASH_PAGE_SIZE - config_free_offset);
+    DebugLog.println(" bytes free.");
+  }
+}
+
+bool configReadHeader(uint32_t page, ConfigPageHeader &header) {
+  memcpy(&header, (const void *) page, sizeof(header));
+
+  return
+    header.magic == CONFIG_PAGE_MAGIC &&
+    header.crc == crc16((const uint8_t *) &header, 8, 0xFFFF);
+}
+
+// Returns offset of the first free byte, loads records into config_entries if load is set
+uint32_t configScanPage(uint32_t page, bool load) {
+  uint32_t offset = CONFIG_HEADER_SIZE;
+
+  while(offset + CONFIG_RECORD_HEADER_SIZE <= FLASH_PAGE_SIZE) {
+    const uint8_t *record = (const uint8_t *) (page + offset);
+    uint8_t key = record[0];
+    uint8_t length = record[1];
+    uint16_t crc = record[2] | (record[3] << 8);
+    uint32_t padded_length = (length + 1) & ~1;
+
+    if(key == 0xFF && length == 0xFF) {
+      break;
     }
 
-    if(!heartbeat_disable_reset_on_arrest) {
-      if(debug_mode) {
-        Serial1.println("Resetting...");
-        delay(50);
-      }
+    if(offset + CONFIG_RECORD_HEADER_SIZE + padded_length > FLASH_PAGE_SIZE) {
+      return FLASH_PAGE_SIZE;
+    }
 
-      digitalWrite(ERROR_LED_PIN, HIGH);
-      HAL_NVIC_SystemReset();
+    // Records interrupted by a reset don't have a matching CRC and are skipped
+    bool valid =
+      key >= 1 && key <= CONFIG_KEYS &&
+      length <= CONFIG_MAX_VALUE_SIZE &&
+      crc == crc16(record + CONFIG_RECORD_HEADER_SIZE, length, crc16(record, 2, 0xFFFF));
+
+    if(load && valid) {
+      ConfigEntry &entry = config_entries[key - 1];
+
+      entry.length = length;
+      entry.dirty = false;
+      memcpy(entry.data, record + CONFIG_RECORD_HEADER_SIZE, length);
+    }
+
+    offset += CONFIG_RECORD_HEADER_SIZE + padded_length;
+  }
+
+  return offset;
+}
+
+bool configGet(uint8_t key, void *value, uint8_t length) {
+  ConfigEntry &entry = config_entries[key - 1];
+
+  if(entry.length != length) {
+    return false;
+  }
+
+  noInterrupts();
+  memcpy(value, entry.data, length);
+  interrupts();
+
+  return true;
+}
+
+// Safe to call from interrupts, the value is written to flash later from loop()
+void configSet(uint8_t key, const void *value, uint8_t length) {
+  ConfigEntry &entry = config_entries[key - 1];
+
+  noInterrupts();
+
+  entry.length = length;
+  entry.dirty = true;
+  memcpy(entry.data, value, length);
+
+  if(!config_pending) {
+    config_pending = true;
+    config_pending_since = millis();
+  }
+
+  interrupts();
+}
+
+void configFlush() {
+  uint32_t start = micros();
+  bool is_successful = true;
+
+  config_pending = false;
+
+  HAL_FLASH_Unlock();
+
+  for(uint8_t key = 1; key <= CONFIG_KEYS; key++) {
+    ConfigEntry &entry = config_entries[key - 1];
+    uint8_t data[CONFIG_MAX_VALUE_SIZE];
+
+    noInterrupts();
+
+    bool dirty = entry.dirty;
+    uint8_t length = entry.length;
+
+    memcpy(data, entry.data, length);
+    entry.dirty = false;
+
+    interrupts();
+
+    if(dirty && !configAppend(key, data, length)) {
+      is_successful = false;
     }
   }
-}
\ No newline at end of file
+
+  HAL_FLASH_Lock();
+
+  config_last_commit_latency = micros() - start;
+  config_commits++;
+
+  if(config_last_commit_latency > config_max_commit_latency) {
+    config_max_commit_latency = config_last_commit_latency;
+  }
+
+  if(!is_successful) {
+    digitalWrite(ERROR_LED_PIN, HIGH);
+  }
+
+  if(debug_mode) {
+    DebugLog.print(is_successful ? "Saved configuration in " : "Error saving configuration after ");
+    DebugLog.print(config_last_commit_latency);
+    DebugLog.println(" us.");
+  }
+}
+
+bool configAppend(uint8_t key, const uint8_t *data, uint8_t length) {
+  uint32_t padded_length = (length + 1) & ~1;
+
+  if(config_free_offset + CONFIG_RECORD_HEADER_SIZE + padded_length > FLASH_PAGE_SIZE) {
+    // Rotation copies the latest value of every key, including this one
+    return configRotate();
+  }
+
+  uint8_t record_header[CONFIG_RECORD_HEADER_SIZE];
+
+  record_header[0] = key;
+  record_header[1] = length;
+
+  uint16_t crc = crc16(data, length, crc16(record_header, 2, 0xFFFF));
+  record_header[2] = crc & 0xFF;
+  record_header[3] = crc >> 8;
+
+  uint8_t padded_data[CONFIG_MAX_VALUE_SIZE + 1] = {};
+  memcpy(padded_data, data, length);
+
+  uint32_t address = config_active_page + config_free_offset;
+
+  // CRC goes last, it marks the record as complete
+  bool is_successful =
+    configProgram(address, record_header, 2) &&
+    configProgram(address + CONFIG_RECORD_HEADER_SIZE, padded_data, padded_length) &&
+    configProgram(address + 2, record_header + 2, 2);
+
+  config_free_offset += CONFIG_RECORD_HEADER_SIZE + padded_length;
+
+  return is_successful;
+}
+
+bool configRotate() {
+  bool to_a = config_active_page != CONFIG_PAGE_A;
+  uint32_t page = to_a ? CONFIG_PAGE_A : CONFIG_PAGE_B;
+  uint32_t &erase_count = config_erase_counts[to_a ? 0 : 1];
+
+  FLASH_EraseInitTypeDef erase = {};
+  uint32_t page_error = 0;
+
+  erase.TypeErase = FLASH_TYPEERASE_PAGES;
+  erase.Banks = FLASH_BANK_1;
+  erase.PageAddress = page;
+  erase.NbPages = 1;
+
+  if(HAL_FLASHEx_Erase(&erase, &page_error) != HAL_OK) {
+    return false;
+  }
+
+  erase_count++;
+
+  uint32_t offset = CONFIG_HEADER_SIZE;
+  bool is_successful = true;
+
+  config_active_page = page;
+  config_free_offset = offset;
+
+  for(uint8_t key = 1; key <= CONFIG_KEYS && is_successful; key++) {
+    ConfigEntry &entry = config_entries[key - 1];
+    uint8_t data[CONFIG_MAX_VALUE_SIZE];
+
+    noInterrupts();
+
+    uint8_t length = entry.length;
+
+    memcpy(data, entry.data, length);
+    entry.dirty = false;
+
+    interrupts();
+
+    if(length > 0) {
+      is_successful = configAppend(key, data, length);
+    }
+  }
+
+  ConfigPageHeader header;
+
+  header.generation = config_generation + 1;
+  header.erase_count = erase_count;
+  header.crc = crc16((const uint8_t *) &header, 8, 0xFFFF);
+  header.magic = CONFIG_PAGE_MAGIC;
+
+  // Magic goes last, the page only becomes valid once everything is copied
+  is_successful =
+    is_successful &&
+    configProgram(page, (const uint8_t *) &header, 10) &&
+    configProgram(page + 10, (const uint8_t *) &header.magic, 2);
+
+  if(is_successful) {
+    config_generation = header.generation;
+  }
+
+  return is_successful;
+}
+
+// Flash has to be unlocked, length has to be even
+bool configProgram(uint32_t address, const uint8_t *data, uint32_t length) {
+  for(uint32_t i = 0; i < length; i += 2) {
+    uint16_t halfword = data[i] | (data[i + 1] << 8);
+
+    if(HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + i, halfword) != HAL_OK) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// CRC-16/CCITT, pass 0xFFFF as crc to start
+uint16_t crc16(const uint8_t *data, uint32_t length, uint16_t crc) {
+  for(uint32_t i = 0; i < length; i++) {
+    crc ^= data[i] << 8;
+
+    for(uint8_t bit = 0; bit < 8; bit++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+
+  return crc;
+}
+
+void restoreCounters() {
+  if(retained_checksum == retainedChecksum()) {
+    recovery_status = RECOVERY_RAM;
+
+    // Calibration continues, but its pulse frequency is only measured from pulses after the reset
+    calibration_timed = false;
+    calibration_timed_pulses = 0;
+  } else {
+    SavedTotals saved_totals = { 0, 0 };
+
+    recovery_status = configGet(CONFIG_KEY_TOTALS, &saved_totals, sizeof(saved_totals)) ? RECOVERY_FLASH : RECOVERY_NONE;
+
+    total_volume = saved_totals.total_volume;
+    lifetime_volume = saved_totals.lifetime_volume;
+    pulse_count = 0;
+    calibration_mode = false;
+    calibration_counter = 0;
+  }
+
+  recovered_totals.total_volume = total_volume;
+  recovered_totals.lifetime_volume = lifetime_volume;
+  saved_lifetime_volume = lifetime_volume;
+
+  retainCounters();
+
+  if(calibration_mode) {
+    digitalWrite(ERROR_LED_PIN, HIGH);
+    digitalWrite(ACTIVE_LED_PIN, HIGH);
+  }
+
+  if(debug_mode) {
+    DebugLog.print("Reset flags 0x");
+    DebugLog.print(reset_flags, 16);
+    DebugLog.print(", ");
+    DebugLog.print(
+      recovery_status == RECOVERY_RAM ? "recovered counters from RAM" :
+      recovery_status == RECOVERY_FLASH ? "recovered totals from flash" :
+      "nothing recovered"
+    );
+    DebugLog.print(": total ");
+    DebugLog.print((uint32_t) (total_volume >> 16));
+    DebugLog.print(" uL, lifetime ");
+    DebugLog.print((uint32_t) (lifetime_volume >> 16));
+    DebugLog.println(" uL.");
+  }
+}
+
+// Has to be called whenever a retained counter changes, cheap enough for the pulse path
+void retainCounters() {
+  retained_checksum = retainedChecksum();
+}
+
+uint32_t retainedChecksum() {
+  return
+    RETAINED_MAGIC ^
+    (uint32_t) total_volume ^ (uint32_t) (total_volume >> 32) ^
+    (uint32_t) lifetime_volume ^ (uint32_t) (lifetime_volume >> 32) ^
+    pulse_count ^
+    calibration_mode ^
+    calibration_counter;
+}
+
+void saveTotals() {
+  SavedTotals saved_totals;
+
+  last_totals_save = millis();
+
+  noInterrupts();
+  saved_totals.total_volume = total_volume;
+  saved_totals.lifetime_volume = lifetime_volume;
+  interrupts();
+
+  if(saved_totals.lifetime_volume == saved_lifetime_volume) {
+    return;
+  }
+
+  saved_lifetime_volume = saved_totals.lifetime_volume;
+
+  configSet(CONFIG_KEY_TOTALS, &saved_totals, sizeof(saved_totals));
+}
+
+void writeChannels() {
+#ifdef HARDWARE_PULSE_COUNTER
+  syncPulseCounter();
+#endif
+#ifdef MULTI_CHANNEL
+  syncChannels();
+#endif
+
+  uint64_t volumes[(1 + EXTRA_CHANNELS) * 2];
+
+  // All channels are taken at the same moment
+  noInterrupts();
+
+  volumes[0] = total_volume;
+  volumes[1] = lifetime_volume;
+
+#ifdef MULTI_CHANNEL
+  for(uint8_t i = 0; i < EXTRA_CHANNELS; i++) {
+    volumes[(i + 1) * 2] = channels[i].total_volume;
+    volumes[(i + 1) * 2 + 1] = channels[i].lifetime_volume;
+  }
+#endif
+
+  interrupts();
+
+  WirePeripheral.write((byte) (1 + EXTRA_CHANNELS));
+
+  for(uint8_t i = 0; i < (1 + EXTRA_CHANNELS) * 2; i++) {
+    writeUint64(volumes[i]);
+  }
+}
+
+#ifdef MULTI_CHANNEL
+void setupChannels() {
+  for(uint8_t i = 0; i < EXTRA_CHANNELS; i++) {
+    HardwareTimer *timer = channel_timers[i];
+
+    pinMode(channel_pins[i], INPUT_PULLUP);
+
+    timer->setPrescaleFactor(1);
+    timer->setOverflow(0x10000, TICK_FORMAT);
+
+    // Timer is clocked by rising edges of its CH1 pin through the same input filter as TIM2 ETR
+    TIM_SlaveConfigTypeDef slave_config = {};
+    slave_config.SlaveMode = TIM_SLAVEMODE_EXTERNAL1;
+    slave_config.InputTrigger = TIM_TS_TI1FP1;
+    slave_config.TriggerPolarity = TIM_TRIGGERPOLARITY_RISING;
+    slave_config.TriggerPrescaler = TIM_TRIGGERPRESCALER_DIV1;
+    slave_config.TriggerFilter = PULSE_COUNTER_FILTER;
+
+    if(HAL_TIM_SlaveConfigSynchro(timer->getHandle(), &slave_config) != HAL_OK) {
+      digitalWrite(ERROR_LED_PIN, HIGH);
+
+      if(debug_mode) {
+        DebugLog.print("Failed to set up counter of channel ");
+        DebugLog.println(i + 1);
+      }
+    }
+
+    timer->setCount(0);
+    channel_last_counts[i] = 0;
+    timer->resume();
+  }
+}
+
+void syncChannels() {
+  noInterrupts();
+
+  for(uint8_t i = 0; i < EXTRA_CHANNELS; i++) {
+    uint16_t count = channel_timers[i]->getCount(TICK_FORMAT);
+    uint16_t new_pulses = count - channel_last_counts[i];
+
+    if(new_pulses == 0) {
+      continue;
+    }
+
+    PulseChannel &channel = channels[i];
+    uint64_t volume = (uint64_t) new_pulses * channel_volume_per_pulse[i];
+
+    channel.total_volume += volume;
+    channel.lifetime_volume += volume;
+    channel.pulse_count += new_pulses;
+
+    if(channel.calibration_mode) {
+      channel.calibration_counter += new_pulses;
+    }
+
+    channel_last_counts[i] = count;
+  }
+
+  channels_checksum = channelsChecksum();
+
+  interrupts();
+}
+
+void restoreChannels() {
+  SavedTotals saved_totals[EXTRA_CHANNELS] = {};
+
+  for(uint8_t i = 0; i < EXTRA_CHANNELS; i++) {
+    channel_volume_per_pulse[i] = (uint32_t) 170 << 16;
+  }
+
+  if(configGet(CONFIG_KEY_CHANNEL_VOLUME_PER_PULSE, channel_volume_per_pulse, sizeof(channel_volume_per_pulse))) {
+    for(uint8_t i = 0; i < EXTRA_CHANNELS; i++) {
+      if(channel_volume_per_pulse[i] == 0) {
+        channel_volume_per_pulse[i] = (uint32_t) 170 << 16;
+      }
+    }
+  }
+
+  // Same as the primary channel, RAM first and the last save to flash after power loss
+  if(channels_checksum != channelsChecksum()) {
+    configGet(CONFIG_KEY_CHANNEL_TOTALS, saved_totals, sizeof(saved_totals));
+
+    for(uint8_t i = 0; i < EXTRA_CHANNELS; i++) {
+      channels[i] = {};
+      channels[i].total_volume = saved_totals[i].total_volume;
+      channels[i].lifetime_volume = saved_totals[i].lifetime_volume;
+    }
+
+    channels_checksum = channelsChecksum();
+  }
+
+  saved_channels_lifetime_volume = 0;
+
+  for(uint8_t i = 0; i < EXTRA_CHANNELS; i++) {
+    saved_channels_lifetime_volume += channels[i].lifetime_volume;
+
+    if(debug_mode) {
+      DebugLog.print("Channel ");
+      DebugLog.print(i + 1);
+      DebugLog.print(": volume per pulse ");
+      DebugLog.print(channel_volume_per_pulse[i] >> 16);
+      DebugLog.print(" + ");
+      DebugLog.print(channel_volume_per_pulse[i] & 0xFFFF);
+      DebugLog.print("/65536 uL, total ");
+      DebugLog.print((uint32_t) (channels[i].total_volume >> 16));
+      DebugLog.print(" uL, lifetime ");
+      DebugLog.print((uint32_t) (channels[i].lifetime_volume >> 16));
+      DebugLog.println(" uL.");
+    }
+  }
+}
+
+uint32_t channelsChecksum() {
+  const uint32_t *words = (const uint32_t *) channels;
+  const uint32_t word_count = sizeof(channels) / 4;
+  uint32_t checksum = RETAINED_MAGIC;
+
+  for(uint32_t i = 0; i < word_count; i++) {
+    checksum = (checksum << 1 | checksum >> 31) ^ words[i];
+  }
+
+  return checksum;
+}
+
+void saveChannelTotals() {
+  SavedTotals saved_totals[EXTRA_CHANNELS];
+  uint64_t lifetime_volume_sum = 0;
+
+  noInterrupts();
+
+  for(uint8_t i = 0; i < EXTRA_CHANNELS; i++) {
+    saved_totals[i].total_volume = channels[i].total_volume;
+    saved_totals[i].lifetime_volume = channels[i].lifetime_volume;
+    lifetime_volume_sum += channels[i].lifetime_volume;
+  }
+
+  interrupts();
+
+  if(lifetime_volume_sum == saved_channels_lifetime_volume) {
+    return;
+  }
+
+  saved_channels_lifetime_volume = lifetime_volume_sum;
+
+  configSet(CONFIG_KEY_CHANNEL_TOTALS, saved_totals, sizeof(saved_totals));
+}
+#endif
+
+void armPortion(uint32_t new_portion_size) {
+#ifdef HARDWARE_PULSE_COUNTER
+  syncPulseCounter();
+#endif
+
+  noInterrupts();
+
+  digitalWriteFast(digitalPinToPinName(CUTOFF_PIN), LOW);
+
+  // Trigger early by the volume that is expected to still flow after cut-off
+  uint32_t cutoff_size = new_portion_size > portion_compensation ? new_portion_size - portion_compensation : 0;
+
+  portion_size = new_portion_size;
+  portion_start_volume = lifetime_volume;
+  portion_cutoff_volume = lifetime_volume + ((uint64_t) cutoff_size << 16);
+  portion_state = PORTION_ARMED;
+
+#ifdef HARDWARE_PULSE_COUNTER
+  // Next compare may still be FLOW_RATE_DECIMATION pulses away, the next pulse picks the step for the new cut-off
+  PulseCounterTimer.setCaptureCompare(1, (uint16_t) (PulseCounterTimer.getCount(TICK_FORMAT) + 1), TICK_FORMAT);
+#endif
+
+  interrupts();
+
+  digitalWrite(ACTIVE_LED_PIN, HIGH);
+}
+
+void cancelPortion() {
+  noInterrupts();
+
+  portion_state = PORTION_IDLE;
+  digitalWriteFast(digitalPinToPinName(CUTOFF_PIN), LOW);
+
+  interrupts();
+
+  digitalWrite(ACTIVE_LED_PIN, LOW);
+}
+
+void finishPortion() {
+#ifdef HARDWARE_PULSE_COUNTER
+  syncPulseCounter();
+#endif
+
+  noInterrupts();
+
+  // Could have been re-armed or cancelled in the meantime
+  if(portion_state != PORTION_REACHED) {
+    interrupts();
+    return;
+  }
+
+  uint64_t end_volume = lifetime_volume;
+  uint32_t dispensed = (uint32_t) ((end_volume - portion_start_volume) >> 16);
+  uint32_t after_cutoff = (uint32_t) ((end_volume - portion_reached_volume) >> 16);
+
+  portion_overshoot = (int32_t) (dispensed - portion_size);
+  portion_state = PORTION_FINISHED;
+  raiseAttention(ATTENTION_PORTION);
+
+  interrupts();
+
+  // Exponential moving average of what flowed after cut-off over recent pours
+  portion_compensation = (int32_t) portion_compensation +
+    ((int32_t) after_cutoff - (int32_t) portion_compensation) / PORTION_COMPENSATION_WEIGHT;
+
+  digitalWrite(ACTIVE_LED_PIN, LOW);
+
+  if(debug_mode) {
+    DebugLog.print("Portion finished. Dispensed ");
+    DebugLog.print(dispensed);
+    DebugLog.print(" of ");
+    DebugLog.print(portion_size);
+    DebugLog.print(" uL, ");
+    DebugLog.print(after_cutoff);
+    DebugLog.print(" uL after cut-off. New compensation ");
+    DebugLog.print(portion_compensation);
+    DebugLog.println(" uL.");
+  }
+}
+
+void requestEvent() {
+  recordWakeLatency();
+
+  switch(read_mode) {
+    case READ_FLOW_RATE:
+      {
+        uint32_t flow_rate = getFlowRate();
+
+        writeUint32(flow_rate);
+
+        if(debug_mode) {
+          DebugLog.print("Responded to I2C request from controller with flow rate ");
+          DebugLog.println(flow_rate);
+        }
+      }
+      break;
+    case READ_CALIBRATION_TABLE:
+      {
+        WirePeripheral.write((uint8_t) calibration_table.count);
+
+        for(uint32_t i = 0; i < CALIBRATION_POINTS; i++) {
+          if(i < calibration_table.count) {
+            writeUint32(calibration_table.points[i].pulse_frequency);
+            writeUint32(calibration_table.points[i].volume_per_pulse);
+          } else {
+            writeUint32(0);
+            writeUint32(0);
+          }
+        }
+
+        if(debug_mode) {
+          DebugLog.println("Responded to I2C request from controller with calibration curve.");
+        }
+      }
+      break;
+    case READ_TOTALS:
+      {
+#ifdef HARDWARE_PULSE_COUNTER
+        syncPulseCounter();
+#endif
+
+        // Both totals are taken together so the pulse path can't update one in between
+        noInterrupts();
+        uint64_t total_volume_snapshot = total_volume;
+        uint64_t lifetime_volume_snapshot = lifetime_volume;
+        interrupts();
+
+        writeUint64(total_volume_snapshot);
+        writeUint64(lifetime_volume_snapshot);
+
+        if(debug_mode) {
+          DebugLog.print("Responded to I2C request from controller with totals ");
+          DebugLog.print((uint32_t) (total_volume_snapshot >> 16));
+          DebugLog.print(" / ");
+          DebugLog.println((uint32_t) (lifetime_volume_snapshot >> 16));
+        }
+      }
+      break;
+    case READ_PORTION:
+      {
+#ifdef HARDWARE_PULSE_COUNTER
+        syncPulseCounter();
+#endif
+
+        noInterrupts();
+        byte portion_state_snapshot = portion_state;
+        uint32_t dispensed = portion_state == PORTION_IDLE ? 0 : (uint32_t) ((lifetime_volume - portion_start_volume) >> 16);
+        interrupts();
+
+        WirePeripheral.write(portion_state_snapshot);
+        writeUint32(portion_size);
+        writeUint32(dispensed);
+        writeUint32((uint32_t) portion_overshoot);
+        writeUint32(portion_compensation);
+
+        if(debug_mode) {
+          DebugLog.print("Responded to I2C request from controller with portion status 0x");
+          DebugLog.println(portion_state_snapshot, 16);
+        }
+      }
+      break;
+    case READ_CONFIG_STATS:
+      {
+        writeUint32(config_erase_counts[0]);
+        writeUint32(config_erase_counts[1]);
+        writeUint32(config_generation);
+        writeUint32(config_commits);
+        writeUint32(config_last_commit_latency);
+        writeUint32(config_max_commit_latency);
+        writeUint32(FLASH_PAGE_SIZE - config_free_offset);
+        WirePeripheral.write((uint8_t) config_pending);
+
+        if(debug_mode) {
+          DebugLog.println("Responded to I2C request from controller with configuration store statistics.");
+        }
+      }
+      break;
+    case READ_ATTENTION:
+      {
+        writeAttention();
+      }
+      break;
+    case READ_IDLE_STATS:
+      {
+        writeIdleStats();
+      }
+      break;
+#ifdef PULSE_BENCH
+    case READ_BENCH:
+      {
+        writeBench();
+      }
+      break;
+#endif
+    case READ_CHANNELS:
+      {
+        writeChannels();
+
+        if(debug_mode) {
+          DebugLog.println("Responded to I2C request from controller with all channels.");
+        }
+      }
+      break;
+    case READ_FLOW_QUALITY:
+      {
+        writeFlowQuality();
+
+        if(debug_mode) {
+          DebugLog.println("Responded to I2C request from controller with flow quality.");
+        }
+      }
+      break;
+    case READ_RECOVERY:
+      {
+        WirePeripheral.write(recovery_status);
+        WirePeripheral.write(reset_flags);
+        writeUint64(recovered_totals.total_volume);
+        writeUint64(recovered_totals.lifetime_volume);
+
+        if(debug_mode) {
+          DebugLog.println("Responded to I2C request from controller with recovery status.");
+        }
+      }
+      break;
+    case READ_SAMPLES:
+      {
+#ifdef HARDWARE_PULSE_COUNTER
+        syncPulseCounter();
+#endif
+
+        writeSamples();
+      }
+      break;
+    default:
+      {
+#ifdef HARDWARE_PULSE_COUNTER
+        syncPulseCounter();
+#endif
+
+        noInterrupts();
+        uint32_t total_volume_snapshot = (uint32_t) (total_volume >> 16);
+        interrupts();
+
+        writeUint32(total_volume_snapshot);
+
+        if(debug_mode) {
+          DebugLog.print("Responded to I2C request from controller with value ");
+          DebugLog.println(total_volume_snapshot);
+        }
+      }
+  }
+
+  read_mode = READ_TOTAL_VOLUME;
+}
+
+void writeUint32(uint32_t value) {
+  char value_bytes[4] = {
+    (char) (value >> 24),
+    (char) (value >> 16),
+    (char) (value >> 8),
+    (char) value
+  };
+
+  WirePeripheral.write(value_bytes, 4);
+}
+
+void writeUint64(uint64_t value) {
+  writeUint32((uint32_t) (value >> 32));
+  writeUint32((uint32_t) value);
+}
+
+uint32_t readUint32(const char* data_bytes) {
+  const uint8_t *bytes = (const uint8_t *) data_bytes;
+
+  return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
+}
+
+void receiveEvent(int how_many) {
+  recordWakeLatency();
+
+  // Commands can leave configuration to be written to flash
+  loop_work_pending = true;
+
+  if(debug_mode) {
+    DebugLog.print("Receiving ");
+    DebugLog.print(how_many);
+    DebugLog.println(" bytes from controller.");
+  }
+
+  char command = '\0';
+  String data = "";
+
+  while(WirePeripheral.available()) {
+    if(!command) {
+      command = (char) WirePeripheral.read();
+    } else {
+      data += (char) WirePeripheral.read();
+    }
+  }
+
+  if(debug_mode) {
+    DebugLog.print("Received command 0x");
+    DebugLog.println(command, 16);
+  }
+
+  switch(command) {
+    case 0x00:
+      break;
+    case 0x01: // Receive heartbeat
+      {
+        last_heartbeat = millis();
+
+        if(debug_mode) {
+          DebugLog.println("Received heartbeat.");
+        }
+      }
+      break;
+    case 0x02: // Reset total volume
+      {
+        digitalWrite(ERROR_LED_PIN, LOW);
+
+        clearTotalVolume();
+
+        if(debug_mode) {
+          DebugLog.println("Reset total volume to 0.");
+        }
+      }
+      break;
+    case 0x03: // Set volume per pulse
+      {
+        if(data.length() != 4) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for setting volume per pulse.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        uint32_t new_volume_per_pulse = readUint32(data.c_str());
+
+        if(debug_mode) {
+          DebugLog.print("Received new volume per pulse: ");
+          DebugLog.println(new_volume_per_pulse);
+        }
+
+        if(new_volume_per_pulse == 0 || new_volume_per_pulse > MAX_VOLUME_PER_PULSE) {
+          if(debug_mode) {
+            DebugLog.println("Volume per pulse out of range.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        updateVolumePerPulse(new_volume_per_pulse);
+      }
+      break;
+    case 0x04: // Enter calibration mode
+      {
+        digitalWrite(ERROR_LED_PIN, HIGH);
+        digitalWrite(ACTIVE_LED_PIN, HIGH);
+
+#ifdef HARDWARE_PULSE_COUNTER
+        // Pulses from before calibration mustn't be counted as calibration pulses
+        syncPulseCounter();
+#endif
+
+        if(!calibration_mode) {
+          calibration_mode = true;
+          calibration_counter = 0;
+          calibration_timed = false;
+          calibration_timed_pulses = 0;
+          
+          clearTotalVolume();
+
+          if(debug_mode) {
+            DebugLog.println("Entered calibration mode.");
+          }
+        } else {
+          if(debug_mode) {
+            DebugLog.println("Already in calibration mode.");
+          }
+        }
+      }
+      break;
+    case 0x05: // Finish calibration
+      {
+        if(calibration_mode) {
+          digitalWrite(ERROR_LED_PIN, LOW);
+          digitalWrite(ACTIVE_LED_PIN, LOW);
+
+          if(data.length() != 4) {
+            if(debug_mode) {
+              DebugLog.println("Received invalid data for calibration.");
+            }
+          } else {
+            uint32_t volume_calibration_input = readUint32(data.c_str());
+
+#ifdef HARDWARE_PULSE_COUNTER
+            syncPulseCounter();
+#endif
+
+            uint64_t calibrated_volume_per_pulse = 0;
+
+            if(calibration_counter != 0) {
+              calibrated_volume_per_pulse = ((uint64_t) volume_calibration_input << 16) / calibration_counter;
+            }
+
+            if(calibration_counter == 0) {
+              digitalWrite(ERROR_LED_PIN, HIGH);
+
+              if(debug_mode) {
+                DebugLog.println("No pulses counted during calibration.");
+              }
+            } else if(calibrated_volume_per_pulse == 0 || calibrated_volume_per_pulse >= ((uint64_t) MAX_VOLUME_PER_PULSE + 1) << 16) {
+              digitalWrite(ERROR_LED_PIN, HIGH);
+
+              if(debug_mode) {
+                DebugLog.println("Calibrated volume per pulse out of range.");
+              }
+            } else {
+              uint32_t new_volume_per_pulse = calibrated_volume_per_pulse;
+              uint32_t calibration_duration = last_pulse_millis - calibration_first_pulse_millis;
+              uint32_t pulse_frequency = 0;
+
+              // Average pulse frequency of the calibration pour is where the new point goes on the curve
+              if(calibration_duration > 0) {
+                pulse_frequency = (uint64_t) calibration_timed_pulses * 10000 / calibration_duration;
+              }
+
+              if(debug_mode) {
+                DebugLog.print("Calculated new volume per pulse: ");
+                DebugLog.print(new_volume_per_pulse >> 16);
+                DebugLog.print(" + ");
+                DebugLog.print(new_volume_per_pulse & 0xFFFF);
+                DebugLog.print("/65536 at ");
+                DebugLog.print(pulse_frequency / 10);
+                DebugLog.print(".");
+                DebugLog.print(pulse_frequency % 10);
+                DebugLog.println(" Hz");
+              }
+
+              // Single value is kept for firmware without calibration curves
+              volume_per_pulse = (new_volume_per_pulse + 0x8000) >> 16;
+              configSet(CONFIG_KEY_VOLUME_PER_PULSE, &volume_per_pulse, sizeof(volume_per_pulse));
+
+              addCalibrationPoint(pulse_frequency, new_volume_per_pulse);
+            }
+
+            calibration_mode = false;
+            calibration_counter = 0;
+
+            clearTotalVolume();
+
+            if(debug_mode) {
+              DebugLog.println("Finished calibration.");
+            }
+          }
+        } else {
+          digitalWrite(ERROR_LED_PIN, HIGH);
+
+          if(debug_mode) {
+            DebugLog.println("Received finish calibration command, but not in calibration mode.");
+          }
+        }
+      }
+      break;
+    case 0x06: // Cancel calibration
+      {
+        if(calibration_mode) {
+          digitalWrite(ERROR_LED_PIN, LOW);
+          digitalWrite(ACTIVE_LED_PIN, LOW);
+
+          calibration_mode = false;
+          calibration_counter = 0;
+          
+          clearTotalVolume();
+
+          if(debug_mode) {
+            DebugLog.println("Cancelled calibration.");
+          }
+        } else {
+          digitalWrite(ERROR_LED_PIN, HIGH);
+
+          if(debug_mode) {
+            DebugLog.println("Received cancel calibration command, but not in calibration mode.");
+          }
+        }
+      }
+      break;
+    case 0x07: // Read flow rate
+      {
+        read_mode = READ_FLOW_RATE;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return flow rate.");
+        }
+      }
+      break;
+    case 0x08: // Read calibration curve
+      {
+        read_mode = READ_CALIBRATION_TABLE;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return calibration curve.");
+        }
+      }
+      break;
+    case 0x09: // Read total and lifetime volume
+      {
+        read_mode = READ_TOTALS;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return total and lifetime volume.");
+        }
+      }
+      break;
+    case 0x0A: // Arm portion
+      {
+        if(data.length() != 4) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for arming portion.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        uint32_t new_portion_size = readUint32(data.c_str());
+
+        armPortion(new_portion_size);
+
+        if(debug_mode) {
+          DebugLog.print("Armed portion of ");
+          DebugLog.print(new_portion_size);
+          DebugLog.print(" uL with compensation of ");
+          DebugLog.print(portion_compensation);
+          DebugLog.println(" uL.");
+        }
+      }
+      break;
+    case 0x0B: // Cancel portion
+      {
+        cancelPortion();
+
+        if(debug_mode) {
+          DebugLog.println("Cancelled portion.");
+        }
+      }
+      break;
+    case 0x0C: // Read portion status
+      {
+        read_mode = READ_PORTION;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return portion status.");
+        }
+      }
+      break;
+    case 0x0D: // Read samples
+      {
+        read_mode = READ_SAMPLES;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return samples.");
+        }
+      }
+      break;
+    case 0x0F: // Read configuration store statistics
+      {
+        read_mode = READ_CONFIG_STATS;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return configuration store statistics.");
+        }
+      }
+      break;
+    case 0x10: // Read recovery status
+      {
+        read_mode = READ_RECOVERY;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return recovery status.");
+        }
+      }
+      break;
+    case 0x0E: // Set sample decimation
+      {
+        if(data.length() != 2) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for setting sample decimation.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        const uint8_t *data_bytes = (const uint8_t *) data.c_str();
+
+        noInterrupts();
+        sample_decimation = (data_bytes[0] << 8) | data_bytes[1];
+        last_sample_pulses = pulse_count;
+        interrupts();
+
+        if(debug_mode) {
+          DebugLog.print("Set sample decimation to ");
+          DebugLog.print(sample_decimation);
+          DebugLog.println(" pulses.");
+        }
+      }
+      break;
+    case 0x11: // Set foam options
+      {
+        if(data.length() != 1) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for setting foam options.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        foam_options = (byte) data.c_str()[0] & (FOAM_EXCLUDE_AIR | FOAM_CUTOFF);
+
+        configSet(CONFIG_KEY_FOAM_OPTIONS, &foam_options, sizeof(foam_options));
+
+        if(debug_mode) {
+          DebugLog.print("Set foam options to 0x");
+          DebugLog.println(foam_options, 16);
+        }
+      }
+      break;
+    case 0x12: // Read flow quality
+      {
+        read_mode = READ_FLOW_QUALITY;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return flow quality.");
+        }
+      }
+      break;
+    case 0x13: // Read all channels
+      {
+        read_mode = READ_CHANNELS;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return all channels.");
+        }
+      }
+      break;
+    case 0x18: // Set attention volume step
+      {
+        if(data.length() != 4) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for setting attention volume step.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        setAttentionVolumeStep(readUint32(data.c_str()));
+
+        if(debug_mode) {
+          DebugLog.print("Set attention volume step to ");
+          DebugLog.print(attention_volume_step);
+          DebugLog.println(" uL.");
+        }
+      }
+      break;
+    case 0x19: // Set attention mask
+      {
+        if(data.length() != 1) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for setting attention mask.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        noInterrupts();
+        attention_mask = (byte) data.c_str()[0];
+        updateAttentionPin();
+        interrupts();
+
+        if(debug_mode) {
+          DebugLog.print("Set attention mask to 0x");
+          DebugLog.println(attention_mask, 16);
+        }
+      }
+      break;
+    case 0x1A: // Read attention
+      {
+        read_mode = READ_ATTENTION;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return attention reasons.");
+        }
+      }
+      break;
+    case 0x1B: // Read idle statistics
+      {
+        read_mode = READ_IDLE_STATS;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return idle statistics.");
+        }
+      }
+      break;
+#ifdef PULSE_BENCH
+    case 0x1C: // Start pulse bench
+      {
+        if(data.length() != 6 || bench_running) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for starting the pulse bench, or it is still running.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        const uint8_t *bytes = (const uint8_t *) data.c_str();
+        uint32_t frequency = readUint32(data.c_str());
+        uint16_t blocks = (bytes[4] << 8) | bytes[5];
+
+        if(frequency == 0 || blocks == 0) {
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        startBench(frequency, blocks);
+
+        if(debug_mode) {
+          DebugLog.print("Pulse bench generating ");
+          DebugLog.print((uint32_t) blocks * BENCH_BLOCK_PULSES);
+          DebugLog.print(" pulses at ");
+          DebugLog.print(bench_frequency);
+          DebugLog.println(" Hz.");
+        }
+      }
+      break;
+    case 0x1D: // Read pulse bench result
+      {
+        read_mode = READ_BENCH;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return the pulse bench result.");
+        }
+      }
+      break;
+#endif
+#ifdef MULTI_CHANNEL
+    case 0x14: // Set volume per pulse of a channel
+    case 0x15: // Reset a channel
+    case 0x16: // Enter calibration mode of a channel
+    case 0x17: // Finish calibration of a channel
+      {
+        uint8_t channel_number = data.length() > 0 ? (uint8_t) data.c_str()[0] : 0;
+        uint8_t value_length = command == 0x14 || command == 0x17 ? 4 : 0;
+
+        // Primary channel (0) has its own commands
+        if(data.length() != 1u + value_length || channel_number < 1 || channel_number > EXTRA_CHANNELS) {
+          if(debug_mode) {
+            DebugLog.print("Received invalid channel data for command 0x");
+            DebugLog.println(command, 16);
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        uint8_t i = channel_number - 1;
+        uint32_t value = value_length > 0 ? readUint32(data.c_str() + 1) : 0;
+
+        if(command == 0x14 && (value == 0 || value > MAX_VOLUME_PER_PULSE)) {
+          if(debug_mode) {
+            DebugLog.println("Channel volume per pulse out of range.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        // Pulses counted so far belong to the previous state of the channel
+        syncChannels();
+
+        PulseChannel &channel = channels[i];
+
+        if(command == 0x14) {
+          channel_volume_per_pulse[i] = value << 16;
+          configSet(CONFIG_KEY_CHANNEL_VOLUME_PER_PULSE, channel_volume_per_pulse, sizeof(channel_volume_per_pulse));
+        } else if(command == 0x16) {
+          digitalWrite(ACTIVE_LED_PIN, HIGH);
+          channel.calibration_mode = true;
+          channel.calibration_counter = 0;
+        } else if(command == 0x17) {
+          if(!channel.calibration_mode) {
+            if(debug_mode) {
+              DebugLog.println("Channel not in calibration mode.");
+            }
+
+            break;
+          }
+
+          uint64_t calibrated_volume_per_pulse = 0;
+
+          if(channel.calibration_counter != 0) {
+            calibrated_volume_per_pulse = ((uint64_t) value << 16) / channel.calibration_counter;
+          }
+
+          if(channel.calibration_counter == 0) {
+            digitalWrite(ERROR_LED_PIN, HIGH);
+
+            if(debug_mode) {
+              DebugLog.println("No pulses counted during calibration of the channel.");
+            }
+          } else if(calibrated_volume_per_pulse == 0 || calibrated_volume_per_pulse >= ((uint64_t) MAX_VOLUME_PER_PULSE + 1) << 16) {
+            digitalWrite(ERROR_LED_PIN, HIGH);
+
+            if(debug_mode) {
+              DebugLog.println("Calibrated channel volume per pulse out of range.");
+            }
+          } else {
+            channel_volume_per_pulse[i] = calibrated_volume_per_pulse;
+            configSet(CONFIG_KEY_CHANNEL_VOLUME_PER_PULSE, channel_volume_per_pulse, sizeof(channel_volume_per_pulse));
+          }
+        }
+
+        // Reset, entering and finishing calibration all start from zero
+        if(command != 0x14) {
+          noInterrupts();
+          channel.total_volume = 0;
+
+          if(command != 0x16) {
+            channel.calibration_mode = false;
+            channel.calibration_counter = 0;
+          }
+
+          channels_checksum = channelsChecksum();
+          interrupts();
+        }
+
+        if(command == 0x15 || command == 0x17) {
+          digitalWrite(ACTIVE_LED_PIN, calibration_mode || portion_state == PORTION_ARMED ? HIGH : LOW);
+        }
+
+        if(debug_mode) {
+          DebugLog.print("Channel ");
+          DebugLog.print(channel_number);
+          DebugLog.print(": command 0x");
+          DebugLog.print(command, 16);
+          DebugLog.print(" done, volume per pulse ");
+          DebugLog.print(channel_volume_per_pulse[i] >> 16);
+          DebugLog.print(" + ");
+          DebugLog.print(channel_volume_per_pulse[i] & 0xFFFF);
+          DebugLog.println("/65536 uL.");
+        }
+      }
+      break;
+#endif
+    default:
+      {
+        digitalWrite(ERROR_LED_PIN, HIGH);
+
+        if(debug_mode) {
+          DebugLog.print("Unknown command 0x");
+          DebugLog.println(command, 16);
+        }
+      }
+  }
+}
+
+void inputInterruptHandler() {
+  uint32_t pulse_frequency = recordPulses(1);
+
+  addVolume(1, pulse_frequency);
+}
+
+// Returns pulse frequency of the new period in 0.1 Hz, 0 if there is no period yet
+uint32_t recordPulses(uint8_t pulses) {
+  uint32_t now_cycles = DWT->CYCCNT;
+  uint32_t now_millis = millis();
+  uint32_t pulse_frequency = 0;
+
+  // After a pause the first pulse only starts a new period
+  if(flow_rate_timestamped && now_millis - last_pulse_millis < FLOW_RATE_TIMEOUT) {
+    uint32_t period = now_cycles - last_pulse_cycles;
+
+    flow_rate_periods[flow_rate_head] = period;
+    flow_rate_pulses[flow_rate_head] = pulses;
+
+    flow_rate_head = (flow_rate_head + 1) % FLOW_RATE_SAMPLES;
+
+    if(flow_rate_count < FLOW_RATE_SAMPLES) {
+      flow_rate_count++;
+    }
+
+    uint32_t pulse_period = period / pulses;
+
+    pulse_frequency = pulse_period > 0 ? SystemCoreClock * 10 / pulse_period : 0;
+
+    updateFlowQuality(pulse_period, pulses);
+  } else {
+    flow_rate_count = 0;
+
+    interval_samples = 0;
+    air_suspected = false;
+    air_run = 0;
+    flow_quality = FLOW_QUALITY_NONE;
+  }
+
+  if(calibration_mode) {
+    if(!calibration_timed) {
+      calibration_first_pulse_millis = now_millis;
+      calibration_timed = true;
+    } else {
+      calibration_timed_pulses += pulses;
+    }
+  }
+
+  last_pulse_cycles = now_cycles;
+  last_pulse_millis = now_millis;
+  last_pulse_frequency = pulse_frequency;
+  flow_rate_timestamped = true;
+
+  return pulse_frequency;
+}
+
+uint32_t getFlowRate() {
+  uint32_t window_cycles = FLOW_RATE_WINDOW * (SystemCoreClock / 1000);
+  uint32_t cycles = 0;
+  uint32_t pulses = 0;
+
+  noInterrupts();
+
+  uint32_t now_cycles = DWT->CYCCNT;
+  uint32_t now_millis = millis();
+  uint8_t count = flow_rate_count;
+
+  if(count == 0 || now_millis - last_pulse_millis >= FLOW_RATE_TIMEOUT) {
+    interrupts();
+    return 0;
+  }
+
+  // Average the newest periods covering FLOW_RATE_WINDOW (at least one period)
+  uint8_t index = flow_rate_head;
+
+  for(uint8_t i = 0; i < count && cycles < window_cycles; i++) {
+    index = (index + FLOW_RATE_SAMPLES - 1) % FLOW_RATE_SAMPLES;
+
+    cycles += flow_rate_periods[index];
+    pulses += flow_rate_pulses[index];
+  }
+
+  uint8_t newest = (flow_rate_head + FLOW_RATE_SAMPLES - 1) % FLOW_RATE_SAMPLES;
+  uint32_t newest_period = flow_rate_periods[newest];
+  uint32_t newest_pulses = flow_rate_pulses[newest];
+  uint32_t open_cycles = now_cycles - last_pulse_cycles;
+
+  interrupts();
+
+  uint64_t pulse_frequency = (uint64_t) pulses * SystemCoreClock * 1000 / cycles; // mHz
+
+  // At low flow only a pulse or two arrives per poll. If the current period is already longer
+  // than the newest one, the flow has slowed down at least to what the open period allows.
+  if(open_cycles > newest_period) {
+    uint64_t open_pulse_frequency = (uint64_t) newest_pulses * SystemCoreClock * 1000 / open_cycles;
+
+    if(open_pulse_frequency < pulse_frequency) {
+      pulse_frequency = open_pulse_frequency;
+    }
+  }
+
+  uint64_t flow_rate = (pulse_frequency * volumePerPulseAt(pulse_frequency / 100) / 1000) >> 16;
+
+  return flow_rate > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) flow_rate;
+}
+
+// Called from the pulse path with the interval per pulse of the newest period, must not use floating point
+void updateFlowQuality(uint32_t interval, uint8_t pulses) {
+  if(interval_samples == 0) {
+    interval_mean = interval;
+    interval_variance = 0;
+    interval_jitter = 0;
+    last_interval = interval;
+    interval_samples = 1;
+    short_burst = false;
+    return;
+  }
+
+  // Judged against the statistics before this interval, so a single odd interval stands out.
+  // Opening the tap also spreads intervals and shortens them below the lagging mean, but
+  // smoothly: consecutive intervals stay close, so jitter stays low compared to deviation.
+  bool is_spread = interval_variance > (uint64_t) interval_mean * interval_mean / 10000 * (FOAM_CV_LIMIT * FOAM_CV_LIMIT);
+  bool is_irregular = (uint64_t) interval_jitter * interval_jitter >= interval_variance / 10000 * (FOAM_MIN_JITTER * FOAM_MIN_JITTER);
+  bool is_foamy = is_spread && is_irregular;
+  bool is_short = (uint64_t) interval * 100 < (uint64_t) interval_mean * FOAM_SHORT_INTERVAL;
+  bool is_sudden = (uint64_t) interval * 100 < (uint64_t) last_interval * FOAM_SHORT_INTERVAL;
+  bool is_judged = interval_samples >= FOAM_MIN_SAMPLES;
+
+  // Air makes the turbine jump to free spinning, a ramp gets there one small step at a time
+  short_burst = is_short && (is_sudden || short_burst);
+
+  // Exponentially weighted mean and variance (West's incremental algorithm with a fixed weight)
+  int32_t delta = (int32_t) (interval - interval_mean);
+  int32_t jitter_delta = (int32_t) (interval > last_interval ? interval - last_interval : last_interval - interval) - (int32_t) interval_jitter;
+
+  interval_mean += delta / (1 << FOAM_STATS_SHIFT);
+  interval_variance += ((int64_t) delta * delta - (int64_t) interval_variance) / (1 << FOAM_STATS_SHIFT);
+  interval_jitter += jitter_delta / (1 << FOAM_STATS_SHIFT);
+  last_interval = interval;
+
+  if(interval_samples < FOAM_MIN_SAMPLES) {
+    interval_samples++;
+  }
+
+  air_suspected = is_judged && (is_foamy || short_burst);
+
+  if(air_suspected) {
+    air_run = air_run + pulses > 0xFFFF ? 0xFFFF : air_run + pulses;
+  } else {
+    air_run = 0;
+  }
+
+  byte new_flow_quality = !is_judged ? FLOW_QUALITY_NONE : is_foamy ? FLOW_QUALITY_FOAM : FLOW_QUALITY_LIQUID;
+
+  if(new_flow_quality == FLOW_QUALITY_FOAM && flow_quality != FLOW_QUALITY_FOAM) {
+    raiseAttention(ATTENTION_FOAM);
+  }
+
+  flow_quality = new_flow_quality;
+}
+
+void writeFlowQuality() {
+  noInterrupts();
+
+  bool is_flowing = millis() - last_pulse_millis < FLOW_RATE_TIMEOUT;
+  byte quality = is_flowing ? flow_quality : FLOW_QUALITY_NONE;
+  uint32_t mean = interval_mean;
+  uint64_t variance = interval_variance;
+  uint32_t jitter = interval_jitter;
+  uint16_t run = is_flowing ? air_run : 0;
+  uint32_t pulses = air_pulses;
+  uint64_t volume = air_volume;
+
+  interrupts();
+
+  uint32_t cycles_per_microsecond = SystemCoreClock / 1000000;
+  uint32_t deviation = squareRoot(variance);
+
+  WirePeripheral.write(quality);
+  WirePeripheral.write(foam_options);
+  writeUint32(mean > 0 ? (uint32_t) ((uint64_t) deviation * 1000 / mean) : 0); // Per mille
+  writeUint32(mean / cycles_per_microsecond);
+  writeUint32(deviation / cycles_per_microsecond);
+  writeUint32(jitter / cycles_per_microsecond);
+  writeUint32(run);
+  writeUint32(pulses);
+  writeUint32((uint32_t) (volume >> 16));
+}
+
+uint32_t squareRoot(uint64_t value) {
+  uint64_t root = 0;
+  uint64_t bit = (uint64_t) 1 << 62;
+
+  while(bit > value) {
+    bit >>= 2;
+  }
+
+  while(bit != 0) {
+    if(value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+
+    bit >>= 2;
+  }
+
+  return (uint32_t) root;
+}
+
+#ifdef PULSE_BENCH
+// TIM1 outputs a PWM pulse train on BENCH_PIN. With the repetition counter, the update interrupt only fires
+// every BENCH_BLOCK_PULSES pulses, and one-pulse mode stops the timer exactly at the end of the last block,
+// so the number of pulses is exact and the bench barely adds to the interrupt load it measures.
+void startBench(uint32_t frequency, uint16_t blocks) {
+#ifdef HARDWARE_PULSE_COUNTER
+  syncPulseCounter();
+#endif
+
+  bench_start_pulses = pulse_count;
+  bench_generated = 0;
+  bench_blocks_left = blocks;
+  bench_running = true;
+
+  BenchTimer.pause();
+  BenchTimer.setMode(1, TIMER_OUTPUT_COMPARE_PWM1, BENCH_PIN);
+  BenchTimer.setOverflow(frequency, HERTZ_FORMAT);
+  BenchTimer.setCaptureCompare(1, 50, PERCENT_COMPARE_FORMAT);
+  BenchTimer.attachInterrupt(benchUpdateEvent);
+
+  bench_frequency = BenchTimer.getOverflow(HERTZ_FORMAT);
+
+  // Loads the repetition counter without an update interrupt
+  TIM1->RCR = BENCH_BLOCK_PULSES - 1;
+  TIM1->CR1 |= TIM_CR1_URS;
+  TIM1->EGR = TIM_EGR_UG;
+  TIM1->SR = ~TIM_SR_UIF;
+
+  if(blocks == 1) {
+    TIM1->CR1 |= TIM_CR1_OPM;
+  } else {
+    TIM1->CR1 &= ~TIM_CR1_OPM;
+  }
+
+  // Every period starts with a rising edge at CNT = 0
+  BenchTimer.setCount(0);
+  BenchTimer.resume();
+}
+
+void benchUpdateEvent() {
+  bench_generated += BENCH_BLOCK_PULSES;
+  bench_blocks_left--;
+
+  if(bench_blocks_left == 1) {
+    // Counter stops at the end of the next block
+    TIM1->CR1 |= TIM_CR1_OPM;
+  } else if(bench_blocks_left == 0) {
+    BenchTimer.pause();
+    bench_running = false;
+  }
+}
+
+void writeBench() {
+#ifdef HARDWARE_PULSE_COUNTER
+  syncPulseCounter();
+#endif
+
+  noInterrupts();
+  uint32_t generated = bench_generated;
+  uint32_t counted = pulse_count - bench_start_pulses;
+  interrupts();
+
+  WirePeripheral.write((uint8_t) bench_running);
+  writeUint32(bench_frequency);
+  writeUint32(generated);
+  writeUint32(counted);
+  writeUint32((uint32_t) ((int32_t) counted - (int32_t) generated));
+
+  if(debug_mode) {
+    DebugLog.print("Pulse bench counted ");
+    DebugLog.print(counted);
+    DebugLog.print(" of ");
+    DebugLog.print(generated);
+    DebugLog.println(" pulses.");
+  }
+}
+#endif
+
+#ifdef HARDWARE_PULSE_COUNTER
+void setupPulseCounter() {
+  // TIM2 is clocked by the flow meter itself through its ETR pin (external clock mode 2),
+  // so pulses are counted without any CPU involvement. The overflow interrupt extends
+  // the 16-bit counter to 32 bits.
+  PulseCounterTimer.setOverflow(0x10000, TICK_FORMAT);
+  PulseCounterTimer.attachInterrupt(pulseCounterOverflowEvent);
+
+  // Compare channel fires every pulse at low flow and every FLOW_RATE_DECIMATION pulses
+  // at high flow to timestamp pulses for flow rate
+  PulseCounterTimer.setMode(1, TIMER_OUTPUT_COMPARE);
+  PulseCounterTimer.setCaptureCompare(1, 1, TICK_FORMAT);
+  PulseCounterTimer.attachInterrupt(1, pulseCounterCompareEvent);
+
+  TIM_ClockConfigTypeDef clock_config = {};
+  clock_config.ClockSource = TIM_CLOCKSOURCE_ETRMODE2;
+  clock_config.ClockPolarity = TIM_CLOCKPOLARITY_NONINVERTED;
+  clock_config.ClockPrescaler = TIM_CLOCKPRESCALER_DIV1;
+  clock_config.ClockFilter = PULSE_COUNTER_FILTER;
+
+  if(HAL_TIM_ConfigClockSource(PulseCounterTimer.getHandle(), &clock_config) != HAL_OK) {
+    digitalWrite(ERROR_LED_PIN, HIGH);
+  }
+
+  PulseCounterTimer.setCount(0);
+  PulseCounterTimer.resume();
+}
+
+// Must be called with interrupts disabled
+uint32_t readPulseCounter() {
+  uint32_t high = pulse_counter_overflows;
+  uint32_t low = PulseCounterTimer.getCount(TICK_FORMAT);
+
+  // The counter may have wrapped without the overflow interrupt having run yet
+  // (e.g. when called from a higher priority interrupt)
+  if(__HAL_TIM_GET_FLAG(PulseCounterTimer.getHandle(), TIM_FLAG_UPDATE) && low < 0x8000) {
+    high++;
+  }
+
+  return (high << 16) | low;
+}
+
+void syncPulseCounter() {
+  noInterrupts();
+
+  uint32_t pulses = readPulseCounter();
+  uint32_t new_pulses = pulses - synced_pulses;
+  synced_pulses = pulses;
+
+  if(new_pulses > 0) {
+    addVolume(new_pulses, last_pulse_frequency);
+  }
+
+  interrupts();
+}
+
+void pulseCounterOverflowEvent() {
+  pulse_counter_overflows++;
+}
+
+void pulseCounterCompareEvent() {
+  uint16_t compare = PulseCounterTimer.getCaptureCompare(1, TICK_FORMAT);
+  uint16_t pulses = compare - pulse_counter_last_compare;
+
+  pulse_counter_last_compare = compare;
+
+  uint32_t pulse_frequency = recordPulses(pulses > 0xFF ? 0xFF : pulses);
+
+  // Volume of these pulses is added with their own pulse frequency
+  syncPulseCounter();
+
+  // Only decimate once the newest period shows a high pulse frequency
+  uint16_t step = 1;
+
+  if(pulse_frequency > FLOW_RATE_DECIMATION_FREQUENCY * 10) {
+    step = FLOW_RATE_DECIMATION;
+
+    // Close to the portion cut-off every pulse has to be seen
+    uint64_t decimated_volume = (uint64_t) volumePerPulseAt(pulse_frequency) * FLOW_RATE_DECIMATION * 2;
+
+    if(portion_state == PORTION_ARMED && portion_cutoff_volume - lifetime_volume < decimated_volume) {
+      step = 1;
+    }
+  }
+
+  uint16_t next_compare = compare + step;
+  uint16_t count = PulseCounterTimer.getCount(TICK_FORMAT);
+
+  // Pulses may have arrived while handling this interrupt
+  if((uint16_t) (next_compare - count - 1) >= FLOW_RATE_DECIMATION) {
+    next_compare = count + step;
+  }
+
+  PulseCounterTimer.setCaptureCompare(1, next_compare, TICK_FORMAT);
+}
+#endif
+
+void heartbeatEvent() {
+  uint32_t diff = millis() - last_heartbeat;
+
+  if(diff > HB_TIMEOUT) {
+    if(debug_mode && !heartbeat_disable_reset_on_arrest) {
+      DebugLog.println("Heartbeat arrest.");
+    }
+
+    if(!heartbeat_disable_reset_on_arrest) {
+      if(debug_mode) {
+        DebugLog.println("Resetting...");
+        DebugLog.flush();
+      }
+
+#ifdef HARDWARE_PULSE_COUNTER
+      // Counters in RAM survive the reset, pulses still in the timer don't
+      syncPulseCounter();
+#endif
+#ifdef MULTI_CHANNEL
+      syncChannels();
+#endif
+
+      digitalWrite(ERROR_LED_PIN, HIGH);
+      HAL_NVIC_SystemReset();
+    }
+  }
+}
+
+// Safe to call from any context, also with interrupts disabled
+void raiseAttention(byte reason) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  attention_reasons |= reason;
+  updateAttentionPin();
+
+  __set_PRIMASK(primask);
+}
+
+void updateAttentionPin() {
+  digitalWriteFast(digitalPinToPinName(ATTENTION_PIN), (attention_reasons & attention_mask) ? LOW : HIGH);
+}
+
+// Sleeps until the next interrupt, SysTick wakes it up at least every millisecond
+void idleSleep() {
+  // Interrupts are only masked, one arriving between the check and __WFI() still wakes it up
+  __disable_irq();
+
+  if(loop_work_pending) {
+    loop_work_pending = false;
+    __enable_irq();
+    return;
+  }
+
+  uint32_t sleep_start = sleepMicros();
+
+  __DSB();
+  __WFI();
+
+  idle_window_micros += sleepMicros() - sleep_start;
+  idle_window_wakes++;
+
+  wake_cycles = DWT->CYCCNT;
+  wake_pending = true;
+
+  // The interrupt that woke it up runs now
+  __enable_irq();
+
+  wake_pending = false;
+
+  uint32_t window = millis() - idle_window_start;
+
+  if(window >= IDLE_STATS_WINDOW) {
+    // Microseconds per millisecond
+    idle_permille = idle_window_micros / window > 1000 ? 1000 : idle_window_micros / window;
+    idle_wakes = idle_window_wakes;
+
+    idle_window_start += window;
+    idle_window_micros = 0;
+    idle_window_wakes = 0;
+  }
+}
+
+// micros() misses a SysTick interrupt that is pending while interrupts are masked
+uint32_t sleepMicros() {
+  uint32_t ticks = HAL_GetTick();
+  uint32_t value = SysTick->VAL;
+
+  if(SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+    ticks++;
+    value = SysTick->VAL;
+  }
+
+  uint32_t load = SysTick->LOAD + 1;
+
+  return ticks * 1000 + (load - value) * 1000 / load;
+}
+
+// Called first thing in I2C callbacks
+void recordWakeLatency() {
+  if(!wake_pending) {
+    return;
+  }
+
+  wake_pending = false;
+  wake_latency = DWT->CYCCNT - wake_cycles;
+
+  if(wake_latency > wake_latency_max) {
+    wake_latency_max = wake_latency;
+  }
+}
+
+void writeIdleStats() {
+  WirePeripheral.write((byte) (idle_permille >> 8));
+  WirePeripheral.write((byte) idle_permille);
+  writeUint32(idle_wakes);
+  writeUint32(wake_latency);
+  writeUint32(wake_latency_max);
+
+  if(debug_mode) {
+    DebugLog.println("Responded to I2C request from controller with idle statistics.");
+  }
+}
+
+// Reading the reasons clears them and releases the line
+void writeAttention() {
+  noInterrupts();
+
+  byte reasons = attention_reasons;
+
+  attention_reasons = 0;
+  updateAttentionPin();
+
+  interrupts();
+
+  WirePeripheral.write((byte) PER_ADDRESS);
+  WirePeripheral.write(reasons);
+
+  if(debug_mode) {
+    DebugLog.print("Responded to I2C request from controller with attention reasons 0x");
+    DebugLog.println(reasons, 16);
+  }
+}
+
+void setAttentionVolumeStep(uint32_t step) {
+#ifdef HARDWARE_PULSE_COUNTER
+  syncPulseCounter();
+#endif
+
+  noInterrupts();
+
+  attention_volume_step = step;
+
+  // Next multiple of the step above the current total volume
+  if(step > 0) {
+    uint64_t step_volume = (uint64_t) step << 16;
+
+    attention_next_volume = (total_volume / step_volume + 1) * step_volume;
+  }
+
+  interrupts();
+}
@@ -0,0 +1,200 @@
+#ifdef DEBUG_LOGGING
+
+#include "DebugLog.h"
+
+DebugLogClass DebugLog;
+
+void DebugLogClass::begin(uint32_t baud) {
+  RCC->APB2ENR |= RCC_APB2ENR_USART1EN | RCC_APB2ENR_IOPAEN;
+  RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+
+  // PA9 alternate function push-pull, 50MHz
+  GPIOA->CRH = (GPIOA->CRH & ~(0xFu << 4)) | (0xBu << 4);
+
+  USART1->BRR = (HAL_RCC_GetPCLK2Freq() + baud / 2) / baud;
+  USART1->CR3 = USART_CR3_DMAT;
+  USART1->CR1 = USART_CR1_UE | USART_CR1_TE;
+
+  DMA1_Channel4->CCR = 0;
+  DMA1_Channel4->CPAR = (uint32_t) &USART1->DR;
+  DMA1_Channel4->CCR = DMA_CCR_MINC | DMA_CCR_DIR;
+}
+
+// Polls the DMA, so no interrupt handler is needed
+void DebugLogClass::drain() {
+  if(in_flight > 0) {
+    if(!(DMA1->ISR & DMA_ISR_TCIF4)) {
+      return;
+    }
+
+    DMA1->IFCR = DMA_IFCR_CTCIF4;
+    DMA1_Channel4->CCR &= ~DMA_CCR_EN;
+
+    tail = (tail + in_flight) % LOG_BUFFER_SIZE;
+    in_flight = 0;
+  }
+
+  uint32_t pending_dropped = dropped - dropped_reported;
+
+  if(pending_dropped > 0) {
+    uint8_t dropped_record[6] = {
+      LOG_SYNC,
+      LOG_DROPPED,
+      (uint8_t) pending_dropped,
+      (uint8_t) (pending_dropped >> 8),
+      (uint8_t) (pending_dropped >> 16),
+      (uint8_t) (pending_dropped >> 24)
+    };
+
+    if(write(dropped_record, sizeof(dropped_record))) {
+      dropped_reported += pending_dropped;
+    }
+  }
+
+  uint16_t current_head = head;
+
+  if(current_head == tail) {
+    return;
+  }
+
+  // Contiguous part only, the rest goes with the next transfer
+  in_flight = current_head > tail ? current_head - tail : LOG_BUFFER_SIZE - tail;
+
+  DMA1_Channel4->CMAR = (uint32_t) &buffer[tail];
+  DMA1_Channel4->CNDTR = in_flight;
+  DMA1_Channel4->CCR |= DMA_CCR_EN;
+}
+
+void DebugLogClass::flush() {
+  while(in_flight > 0 || head != tail) {
+    drain();
+  }
+
+  while(!(USART1->SR & USART_SR_TC));
+}
+
+uint32_t DebugLogClass::droppedRecords() {
+  return dropped;
+}
+
+// A record is copied whole or not at all, from any context
+bool DebugLogClass::write(const uint8_t *data, uint8_t length) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  uint16_t used = (head + LOG_BUFFER_SIZE - tail) % LOG_BUFFER_SIZE;
+
+  if(used + length >= LOG_BUFFER_SIZE) {
+    __set_PRIMASK(primask);
+    return false;
+  }
+
+  uint16_t position = head;
+
+  for(uint8_t i = 0; i < length; i++) {
+    buffer[position] = data[i];
+    position = (position + 1) % LOG_BUFFER_SIZE;
+  }
+
+  head = position;
+
+  __set_PRIMASK(primask);
+  return true;
+}
+
+void DebugLogClass::record(const uint8_t *data, uint8_t length) {
+  if(!write(data, length)) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    dropped++;
+    __set_PRIMASK(primask);
+  }
+}
+
+void DebugLogClass::recordValue(uint8_t type, uint8_t format, uint64_t value, uint8_t size) {
+  uint8_t data[3 + 8] = { LOG_SYNC, type, format };
+
+  for(uint8_t i = 0; i < size; i++) {
+    data[3 + i] = (uint8_t) (value >> (8 * i));
+  }
+
+  record(data, 3 + size);
+}
+
+void DebugLogClass::recordText(const char *text, uint32_t length) {
+  uint8_t data[3 + LOG_TEXT_MAX] = { LOG_SYNC, LOG_TEXT };
+
+  length = length > LOG_TEXT_MAX ? LOG_TEXT_MAX : length;
+  data[2] = (uint8_t) length;
+  memcpy(&data[3], text, length);
+
+  record(data, 3 + length);
+}
+
+void DebugLogClass::print(const char *text) {
+  uint32_t address = (uint32_t) text;
+
+  // Strings in RAM can change before they are sent, so only constants are sent by address
+  if(address >= FLASH_BASE && address < SRAM_BASE) {
+    uint8_t data[6] = { LOG_SYNC, LOG_STRING, (uint8_t) address, (uint8_t) (address >> 8), (uint8_t) (address >> 16), (uint8_t) (address >> 24) };
+
+    record(data, sizeof(data));
+  } else {
+    recordText(text, strlen(text));
+  }
+}
+
+void DebugLogClass::print(const String &text) {
+  recordText(text.c_str(), text.length());
+}
+
+void DebugLogClass::print(char character) {
+  uint8_t data[3] = { LOG_SYNC, LOG_CHAR, (uint8_t) character };
+
+  record(data, sizeof(data));
+}
+
+void DebugLogClass::print(unsigned char value, int base) {
+  recordValue(LOG_UINT, base, value, 4);
+}
+
+void DebugLogClass::print(int value, int base) {
+  recordValue(LOG_INT, base, (uint32_t) value, 4);
+}
+
+void DebugLogClass::print(unsigned int value, int base) {
+  recordValue(LOG_UINT, base, value, 4);
+}
+
+void DebugLogClass::print(long value, int base) {
+  recordValue(LOG_INT, base, (uint32_t) value, 4);
+}
+
+void DebugLogClass::print(unsigned long value, int base) {
+  recordValue(LOG_UINT, base, value, 4);
+}
+
+void DebugLogClass::print(long long value, int base) {
+  recordValue(LOG_INT64, base, (uint64_t) value, 8);
+}
+
+void DebugLogClass::print(unsigned long long value, int base) {
+  recordValue(LOG_UINT64, base, value, 8);
+}
+
+void DebugLogClass::print(double value, int digits) {
+  float single = (float) value;
+  uint32_t bits;
+
+  memcpy(&bits, &single, sizeof(bits));
+  recordValue(LOG_FLOAT, digits, bits, 4);
+}
+
+void DebugLogClass::println() {
+  uint32_t now = millis();
+  uint8_t data[6] = { LOG_SYNC, LOG_LINE, (uint8_t) now, (uint8_t) (now >> 8), (uint8_t) (now >> 16), (uint8_t) (now >> 24) };
+
+  record(data, sizeof(data));
+}
+
+#endif
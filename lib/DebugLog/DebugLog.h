@@ -0,0 +1,66 @@
+#ifndef DEBUG_LOG_H
+#define DEBUG_LOG_H
+
+#include <Arduino.h>
+
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE 1024 // BYTES OF RECORDS WAITING FOR THE UART
+#endif
+#define LOG_TEXT_MAX 48 // LONGER RAM STRINGS ARE TRUNCATED
+
+// Every record starts with LOG_SYNC and its type, values are little-endian
+#define LOG_SYNC 0xA5
+#define LOG_STRING 0x01 // u32 address of a string in flash, resolved from the firmware image by the decoder
+#define LOG_TEXT 0x02 // u8 length, characters (string in RAM)
+#define LOG_INT 0x03 // u8 base, i32
+#define LOG_UINT 0x04 // u8 base, u32
+#define LOG_INT64 0x05 // u8 base, i64
+#define LOG_UINT64 0x06 // u8 base, u64
+#define LOG_CHAR 0x07 // u8
+#define LOG_FLOAT 0x08 // u8 digits, f32
+#define LOG_LINE 0x09 // u32 milliseconds, ends a line
+#define LOG_DROPPED 0x0A // u32 records dropped because the buffer was full
+
+// Same print()/println() calls as Serial, but only records are copied into a RAM ring buffer,
+// which is sent by DMA (USART1 TX on PA9, DMA1 channel 4). Never blocks, except flush().
+class DebugLogClass {
+  public:
+    void begin(uint32_t baud);
+    void drain(); // Call from the main loop
+    void flush(); // Blocks until everything has been sent
+
+    uint32_t droppedRecords();
+
+    void print(const char*);
+    void print(const String&);
+    void print(char);
+    void print(unsigned char, int = DEC);
+    void print(int, int = DEC);
+    void print(unsigned int, int = DEC);
+    void print(long, int = DEC);
+    void print(unsigned long, int = DEC);
+    void print(long long, int = DEC);
+    void print(unsigned long long, int = DEC);
+    void print(double, int = 2);
+
+    void println();
+    template<typename T> void println(T value) { print(value); println(); }
+    template<typename T> void println(T value, int format) { print(value, format); println(); }
+
+  private:
+    void record(const uint8_t*, uint8_t);
+    bool write(const uint8_t*, uint8_t);
+    void recordValue(uint8_t, uint8_t, uint64_t, uint8_t);
+    void recordText(const char*, uint32_t);
+
+    uint8_t buffer[LOG_BUFFER_SIZE];
+    volatile uint16_t head = 0; // Written by producers with interrupts disabled
+    volatile uint16_t tail = 0; // Written only by drain()
+    uint16_t in_flight = 0; // Bytes being sent by DMA
+    volatile uint32_t dropped = 0;
+    uint32_t dropped_reported = 0;
+};
+
+extern DebugLogClass DebugLog;
+
+#endif
@@ -1,7 +1,20 @@
 #define HB_TIMEOUT 7500 // WILL BE CHECKED 2 TIMES A SECOND
+#define IDLE_CLOCK_GATING 1 // 1 - FLASH AND SRAM (NOT WITH DEBUG_LOGGING) INTERFACE CLOCKS ARE STOPPED WHILE SLEEPING
+#define IDLE_STATS_WINDOW 1000 // MILLISECONDS IDLE TIME IS AVERAGED OVER
+#define URI_MAX_LENGTH 127 // BYTES WITHOUT THE PROTOCOL, LONGER URIS ARE REJECTED WITH 'E'
+#define WRITE_JOB_HISTORY 8 // LATEST WRITES WHOSE STATUS CAN BE READ
+#define NFC_WRITE_CHUNK 16 // BYTES PER I2C WRITE TO THE TAG, MULTIPLE OF ITS 4 BYTE EEPROM BLOCK
+#define NFC_WRITE_TIMEOUT 500 // MILLISECONDS A WRITE CAN TAKE BEFORE IT FAILS
+#define NFC_MAILBOX 1 // 1 - FAST TRANSFER MAILBOX IS ENABLED FOR SESSION URIS (CHANGES THE TAG'S CONFIGURATION)
+#ifndef NFC_I2C_PASSWORD
+#define NFC_I2C_PASSWORD 0x0000000000000000 // 64-BIT I2C SECURITY SESSION PASSWORD, SET IN platformio.ini, A FACTORY TAG IS CHANGED TO IT AT STARTUP
+#endif
+#define EVENT_QUEUE_SIZE 16 // MUST BE A POWER OF 2
+#define EVENT_READ_MAX 8 // EVENTS PER READ, THE RESPONSE IS ALWAYS 6 + 5 * N BYTES, MUST FIT I2C_TXRX_BUFFER_SIZE
 
 #include <Arduino.h>
 #include <Wire.h>
+#include "DebugLog.h"
 #include "ST25DVSensor.h"
 
 #define DEBUG_SWITCH_PIN PA11
@@ -14,33 +27,251 @@
 #define NFC_LPD_PIN -1
 #define NFC_SDA_PIN PB7
 #define NFC_SCL_PIN PB6
+#define NFC_USER_ADDRESS 0x53 // USER MEMORY AND DYNAMIC REGISTERS
+#define NFC_SYSTEM_ADDRESS 0x57 // SYSTEM CONFIGURATION
+
+#define NFC_GPO_REGISTER 0x0000 // System, interrupts signalled on the GPO pin
+#define NFC_MB_MODE_REGISTER 0x000D // System, fast transfer mode allowed
+#define NFC_MB_WDG_REGISTER 0x000E // System, mailbox watchdog
+#define NFC_I2C_PWD_REGISTER 0x0900 // System
+#define NFC_I2C_SSO_REGISTER 0x2004 // Dynamic, I2C security session open
+#define NFC_EH_CTRL_REGISTER 0x2002 // Dynamic, RF field present
+#define NFC_IT_STS_REGISTER 0x2005 // Dynamic, interrupt status, cleared by reading it
+#define NFC_MB_CTRL_REGISTER 0x2006 // Dynamic, mailbox enabled and status
+#define NFC_MAILBOX_ADDRESS 0x2008
+#define NFC_MAILBOX_SIZE 256
+
+#define NFC_GPO_RF_ACTIVITY 0x02
+#define NFC_GPO_FIELD_CHANGE 0x08
+#define NFC_GPO_RF_GET_MSG 0x20
+#define NFC_GPO_ENABLED 0x80
+
+#define NFC_IT_RF_ACTIVITY 0x02
+#define NFC_IT_FIELD_FALLING 0x08
+#define NFC_IT_FIELD_RISING 0x10
+#define NFC_IT_RF_GET_MSG 0x40
+
+#define NFC_EH_FIELD_ON 0x04
+
+#define ATTENTION_PIN PA4 // OPEN-DRAIN, ACTIVE LOW, CAN BE SHARED WITH OTHER COMPONENTS
 
 #define PER_SDA_PIN PB11
 #define PER_SCL_PIN PB10
+#define PER_ADDRESS 0x0F
+
+#define READ_STATUS 0x00
+#define READ_ATTENTION 0x01
+#define READ_IDLE_STATS 0x02
+#define READ_RECEIVE_TIMING 0x03
+#define READ_WRITE_JOB 0x04
+#define READ_WRITE_BENCHMARK 0x05
+#define READ_RF_EVENTS 0x06
+
+#define EVENT_FIELD_ON 0x01 // A phone came close
+#define EVENT_FIELD_OFF 0x02
+#define EVENT_TAG_READ 0x03 // First RF command since the field came on
+#define EVENT_MAILBOX_READ 0x04 // A phone read the session URI
+
+#define TARGET_EEPROM 0 // NDEF area, read by every phone
+#define TARGET_MAILBOX 1 // Fast transfer mailbox, read with the ST25DV's own RF commands
+
+#define JOB_UNKNOWN '\0' // Not issued yet, or too old
+#define JOB_QUEUED 'Q' // Waiting for the write in progress
+#define JOB_WRITING 'W'
+#define JOB_OK 'K'
+#define JOB_ERROR 'E'
+#define JOB_SUPERSEDED 'S' // A newer URI arrived before it was written
+#define JOB_DEFERRED 'D' // Waiting for a phone to leave the field, EEPROM can't be written meanwhile
+
+// NDEF TLV (type, length), URI record (header, type length, payload length, type, protocol ID), URI, terminator TLV
+#define NDEF_OVERHEAD 8
+#define NDEF_MESSAGE_SIZE ((URI_MAX_LENGTH + NDEF_OVERHEAD + 3) / 4 * 4)
+#define NDEF_HEADER_SIZE 8 // Both length fields, always written last and in one go
+
+#define STEP_INVALIDATE 0 // Empties the message, so a reader never gets parts of two URIs
+#define STEP_BODY 1 // Changed blocks after the header
+#define STEP_HEADER 2
+#define STEP_DONE 3
+#define STEP_MAILBOX 4 // Whole message at once, nothing to program
+
+#define ATTENTION_WRITE_OK 0x01 // URI written, status is 'K'
+#define ATTENTION_WRITE_ERROR 0x02 // URI not written, status is 'E'
+#define ATTENTION_RF_EVENT 0x04 // RF event added to the queue
+#define ATTENTION_RF_EVENTS_DROPPED 0x08 // RF event queue was full
+
+struct WriteJob {
+  byte id; // 0 if the slot hasn't been used
+  char status;
+  uint32_t received_at; // Microseconds
+  uint32_t latency; // Microseconds from receiving the URI until it was on the tag, 0 until finished
+  uint32_t write_time; // Microseconds spent writing to the tag
+  uint16_t bytes_written;
+};
+
+struct WriteBenchmark {
+  uint32_t count; // Successful writes that changed something
+  uint32_t last; // Microseconds
+  uint32_t max; // Microseconds
+  uint64_t total; // Microseconds
+};
+
+struct RfEvent {
+  uint8_t type;
+  uint32_t timestamp; // Milliseconds since boot
+};
+
+// Empty NDEF message followed by the terminator
+const byte empty_ndef_message[4] = { 0x03, 0x00, 0xFE, 0x00 };
+
+static_assert(NDEF_MESSAGE_SIZE <= NFC_MAILBOX_SIZE, "Longest message has to fit in the mailbox");
+
+#if NFC_I2C_PASSWORD == 0
+#warning "NFC_I2C_PASSWORD is the factory default, anything on the tag's I2C bus can change its configuration"
+#endif
+
+// Most significant byte first
+constexpr byte nfc_i2c_password[8] = {
+  (byte) ((uint64_t) NFC_I2C_PASSWORD >> 56), (byte) ((uint64_t) NFC_I2C_PASSWORD >> 48),
+  (byte) ((uint64_t) NFC_I2C_PASSWORD >> 40), (byte) ((uint64_t) NFC_I2C_PASSWORD >> 32),
+  (byte) ((uint64_t) NFC_I2C_PASSWORD >> 24), (byte) ((uint64_t) NFC_I2C_PASSWORD >> 16),
+  (byte) ((uint64_t) NFC_I2C_PASSWORD >> 8), (byte) NFC_I2C_PASSWORD
+};
+constexpr byte nfc_factory_password[8] = {};
 
 TwoWire WirePeripheral(PER_SDA_PIN, PER_SCL_PIN);
 TwoWire WireNFC(NFC_SDA_PIN, NFC_SCL_PIN);
-HardwareSerial Serial1(PA10, PA9);
 HardwareTimer HeartbeatTimer(TIM3);
 
+#ifdef DEBUG_LOGGING
 bool debug_mode = false;
+#else
+// Every if(debug_mode) block is compiled out, DebugLog isn't even defined
+constexpr bool debug_mode = false;
+#endif
 bool heartbeat_disable_reset_on_arrest = false;
 
-byte previous_uri_protocol_id = 0x00;
-byte uri_protocol_id = 0x00;
+// One URI can be staged per target, receiveEvent() stages into a buffer loop() isn't writing from
+char staged_uris[3][URI_MAX_LENGTH + 1];
+byte staged_protocol_ids[3];
+volatile byte staged_job_ids[2] = { 0, 0 }; // Per target, 0 if nothing is staged
+byte staged_indexes[2] = { 0, 1 }; // Per target
+
+WriteJob write_jobs[WRITE_JOB_HISTORY]; // Indexed by job ID % WRITE_JOB_HISTORY
+volatile byte last_job_id = 0; // IDs go from 1 to 255 and wrap around
+byte requested_job_id = 0;
+
+byte writing_job_id = 0; // 0 if not writing
+volatile byte writing_index = 2; // Staged buffer being written
+byte writing_target = TARGET_EEPROM;
+bool mailbox_enabled = false;
+WriteBenchmark write_benchmarks[2]; // Per target
+byte ndef_message[NDEF_MESSAGE_SIZE];
+uint16_t ndef_length = 0; // Bytes, multiple of 4
+byte ndef_shadow[NDEF_MESSAGE_SIZE]; // Start of the NDEF area as it is on the tag
+uint16_t ndef_shadow_valid = 0; // Bytes from the start of the shadow known to match the tag, 0 after a failed write
+byte write_step = STEP_DONE;
+uint16_t write_offset = 0; // Next block to check in STEP_BODY
+uint16_t write_bytes = 0; // Written to the tag for the current job
+uint16_t ndef_address = 4; // Start of the NDEF area, after the capability container
+uint16_t ndef_area_size = 0; // Bytes
+uint32_t write_started_at = 0; // Microseconds
+
+volatile bool gpo_pending = false; // GPO pin went low, the interrupt status hasn't been read yet
+volatile uint32_t gpo_pending_at = 0; // Milliseconds, first edge since the status was last read
+bool rf_field_present = false;
+bool tag_read_reported = false; // Since the field came on
+
+// Single producer (loop) single consumer (requestEvent) queue, no locking needed
+RfEvent events[EVENT_QUEUE_SIZE];
+volatile uint8_t event_head = 0; // Written only by the producer
+volatile uint8_t event_tail = 0; // Written only by the consumer
+volatile uint32_t events_dropped = 0; // Written only by the producer
+uint32_t events_dropped_reported = 0; // Written only by the consumer
+
+#define URI_PROTOCOL_COUNT 0x24
+
+// Indexed by protocol ID, 0x00 isn't a valid protocol
+constexpr const char *uri_prefixes[URI_PROTOCOL_COUNT] = {
+  nullptr,
+  URI_ID_0x01_STRING, URI_ID_0x02_STRING, URI_ID_0x03_STRING, URI_ID_0x04_STRING,
+  URI_ID_0x05_STRING, URI_ID_0x06_STRING, URI_ID_0x07_STRING, URI_ID_0x08_STRING,
+  URI_ID_0x09_STRING, URI_ID_0x0A_STRING, URI_ID_0x0B_STRING, URI_ID_0x0C_STRING,
+  URI_ID_0x0D_STRING, URI_ID_0x0E_STRING, URI_ID_0x0F_STRING, URI_ID_0x10_STRING,
+  URI_ID_0x11_STRING, URI_ID_0x12_STRING, URI_ID_0x13_STRING, URI_ID_0x14_STRING,
+  URI_ID_0x15_STRING, URI_ID_0x16_STRING, URI_ID_0x17_STRING, URI_ID_0x18_STRING,
+  URI_ID_0x19_STRING, URI_ID_0x1A_STRING, URI_ID_0x1B_STRING, URI_ID_0x1C_STRING,
+  URI_ID_0x1D_STRING, URI_ID_0x1E_STRING, URI_ID_0x1F_STRING, URI_ID_0x20_STRING,
+  URI_ID_0x21_STRING, URI_ID_0x22_STRING, URI_ID_0x23_STRING
+};
+
+constexpr const char *uriPrefix(byte protocol_id) {
+  return protocol_id < URI_PROTOCOL_COUNT ? uri_prefixes[protocol_id] : nullptr;
+}
 
-char previous_uri[128] = "";
-char uri_message[128] = "";
+static_assert(uriPrefix(0x00) == nullptr && uriPrefix(0x24) == nullptr, "0x00 and IDs past the table aren't protocols");
 
 char output_byte = '\0';
 uint32_t last_heartbeat = 0;
 
-bool writeUri(byte, String);
+byte read_mode = READ_STATUS;
+
+volatile bool loop_work_pending = false; // Set by interrupts that leave work for loop()
+uint32_t idle_window_start = 0; // Milliseconds
+uint32_t idle_window_micros = 0; // Slept in the current window
+uint32_t idle_window_wakes = 0;
+uint16_t idle_permille = 0; // Of the last full window
+uint32_t idle_wakes = 0; // In the last full window
+volatile bool wake_pending = false; // Woken up, the interrupt that woke it hasn't run yet
+uint32_t wake_cycles = 0; // CPU cycles when woken up
+volatile uint32_t wake_latency = 0; // CPU cycles from waking up to the I2C callback that woke it
+volatile uint32_t wake_latency_max = 0;
+
+volatile uint32_t receive_cycles = 0; // CPU cycles the last receiveEvent() took
+volatile uint32_t receive_cycles_max = 0;
+
+volatile byte attention_reasons = 0;
+byte attention_mask = 0xFF; // Reasons that pull the attention line low
+
+void updateWriter();
+void finishWrite(char);
+uint16_t encodeUriMessage(byte, const char *, byte *);
+bool nfcReady(byte);
+bool waitForNfc(byte);
+bool readNfc(byte, uint16_t, byte *, byte);
+bool writeNfc(byte, uint16_t, const byte *, uint16_t);
+bool presentPassword(const byte *, byte);
+bool openSession(const byte *);
+bool closeSession();
+bool provisionPassword();
+bool enableMailbox();
+bool configureGpo();
+void gpoEvent();
+void handleGpo();
+void pushEvent(uint8_t, uint32_t);
+void writeEvents();
+void requeueWrite();
+bool writeMailbox(const byte *, uint16_t);
+bool blockDirty(uint16_t);
+bool writeTag(uint16_t, const byte *, uint16_t);
+bool readTag(uint16_t, byte *, uint16_t);
+bool readCapabilityContainer();
+void stageWrite(byte, byte, const char *, size_t);
+void rejectWrite();
+WriteJob &newWriteJob();
+void writeWriteJob();
+void writeBenchmarks();
 void requestEvent();
 void receiveEvent(int);
 void heartbeatEvent();
-String protocolIdToString(byte);
-String resultToString(int);
+void writeUint32(uint32_t);
+void raiseAttention(byte);
+void updateAttentionPin();
+void writeAttention();
+void idleSleep();
+uint32_t sleepMicros();
+void recordWakeLatency();
+void writeIdleStats();
+void writeReceiveTiming();
 
 void setup() {
   pinMode(ON_LED_PIN, OUTPUT);
@@ -49,11 +280,16 @@ void setup() {
   
   pinMode(DEBUG_SWITCH_PIN, INPUT_PULLDOWN);
 
+  pinMode(ATTENTION_PIN, OUTPUT_OPEN_DRAIN);
+  digitalWrite(ATTENTION_PIN, HIGH);
+
   digitalWrite(ON_LED_PIN, LOW);
   digitalWrite(ACTIVE_LED_PIN, LOW);
   digitalWrite(ERROR_LED_PIN, LOW);
 
+#ifdef DEBUG_LOGGING
   debug_mode = debug_mode || digitalRead(DEBUG_SWITCH_PIN);
+#endif
 
   if(debug_mode) {
     for(byte i = 0; i < 3; i++) {
@@ -76,15 +312,15 @@ void setup() {
   }
 
   if(debug_mode) {
-    Serial1.begin(115200);
-    Serial1.println("Start");
+    DebugLog.begin(115200);
+    DebugLog.println("Start");
 
-    Serial1.println("Debug mode enabled.");
+    DebugLog.println("Debug mode enabled.");
     
     if(heartbeat_disable_reset_on_arrest) {
-      Serial1.println("Heartbeat reset on arrest disabled.");
+      DebugLog.println("Heartbeat reset on arrest disabled.");
     } else {
-      Serial1.println("Heartbeat reset on arrest enabled.");
+      DebugLog.println("Heartbeat reset on arrest enabled.");
     }
   }
 
@@ -92,13 +328,73 @@ void setup() {
     digitalWrite(ERROR_LED_PIN, HIGH);
 
     if(debug_mode) {
-      Serial1.println("Error opening NFC module.");
+      DebugLog.println("Error opening NFC module.");
     }
 
     while(1);
   }
 
-  WirePeripheral.begin(0x0F);
+  if(!readCapabilityContainer() || ndef_area_size < NDEF_MESSAGE_SIZE) {
+    digitalWrite(ERROR_LED_PIN, HIGH);
+
+    if(debug_mode) {
+      DebugLog.println("NFC tag isn't formatted for NDEF.");
+    }
+
+    while(1);
+  }
+
+  ndef_shadow_valid = readTag(0, ndef_shadow, NDEF_MESSAGE_SIZE) ? NDEF_MESSAGE_SIZE : 0;
+
+  if(!provisionPassword() && debug_mode) {
+    DebugLog.println("NFC tag rejected NFC_I2C_PASSWORD, its configuration can't be changed.");
+  }
+
+  if(!configureGpo() && debug_mode) {
+    DebugLog.println("Couldn't configure the NFC GPO, there won't be any RF events.");
+  }
+
+#if NFC_MAILBOX
+  mailbox_enabled = enableMailbox();
+
+  if(debug_mode && !mailbox_enabled) {
+    DebugLog.println("Couldn't enable the NFC mailbox, session URIs will fail.");
+  }
+
+  // TwoWire grows its transmit buffer as needed, this grows it once here instead of on the first mailbox write.
+  // Nothing is sent, the next beginTransmission() starts over.
+  WireNFC.beginTransmission(NFC_USER_ADDRESS);
+
+  for(uint16_t i = 0; i < NDEF_MESSAGE_SIZE + 2; i++) {
+    WireNFC.write((byte) 0x00);
+  }
+#endif
+
+  if(debug_mode) {
+    DebugLog.print("NDEF area starts at ");
+    DebugLog.print(ndef_address);
+    DebugLog.print(" and is ");
+    DebugLog.print(ndef_area_size);
+    DebugLog.println(" bytes long.");
+  }
+
+  // DWT cycle counter measures wake-up latency
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+#if IDLE_CLOCK_GATING
+  // Only stopped while sleeping, an interrupt starts them again
+#ifdef DEBUG_LOGGING
+  // DMA keeps sending the log from SRAM while sleeping
+  RCC->AHBENR &= ~RCC_AHBENR_FLITFEN;
+#else
+  RCC->AHBENR &= ~(RCC_AHBENR_FLITFEN | RCC_AHBENR_SRAMEN);
+#endif
+#endif
+
+  idle_window_start = millis();
+
+  WirePeripheral.begin(PER_ADDRESS);
   WirePeripheral.onRequest(requestEvent);
   WirePeripheral.onReceive(receiveEvent);
 
@@ -112,113 +408,772 @@ void setup() {
 }
 
 void loop() {
-  if(
-    strcmp(uri_message, previous_uri) != 0 ||
-    previous_uri_protocol_id != uri_protocol_id
-  ) {
+  handleGpo();
+  updateWriter();
+
+#ifdef DEBUG_LOGGING
+  DebugLog.drain();
+#endif
+
+  idleSleep();
+}
+
+// Writes one chunk per call, the tag is polled between chunks instead of waiting for it to program them.
+// Only blocks that differ from the shadow copy are written.
+void updateWriter() {
+  if(writing_job_id == 0) {
+    noInterrupts();
+
+    byte job_id = 0;
+
+    // Session URIs first, they're what a customer waits for.
+    // EEPROM waits while a phone is in the field, the tag rejects writes to it meanwhile.
+    for(int8_t target = TARGET_MAILBOX; target >= TARGET_EEPROM; target--) {
+      if(staged_job_ids[target] != 0 && !(target == TARGET_EEPROM && rf_field_present)) {
+        job_id = staged_job_ids[target];
+        writing_index = staged_indexes[target];
+        writing_target = target;
+        staged_job_ids[target] = 0;
+        break;
+      }
+    }
+
+    interrupts();
+
+    if(job_id == 0) {
+      return;
+    }
+
+    writing_job_id = job_id;
+    write_started_at = micros();
+    write_bytes = 0;
+
+    const char *uri = staged_uris[writing_index];
+    byte protocol_id = staged_protocol_ids[writing_index];
+
     if(debug_mode) {
-      Serial1.print("URI to write changed (");
-      Serial1.print(previous_uri);
-      Serial1.print(" -> ");
-      Serial1.print(uri_message);
-      Serial1.println(").");
-      Serial1.print("Protocol to write changed (0x");
-      Serial1.print(previous_uri_protocol_id, 16);
-      Serial1.print(" -> 0x");
-      Serial1.print(uri_protocol_id, 16);
-      Serial1.println(").");
+      DebugLog.print("Writing job ");
+      DebugLog.print(job_id);
+      DebugLog.print(writing_target == TARGET_MAILBOX ? " to the mailbox: " : " to EEPROM: ");
+      DebugLog.print(uriPrefix(protocol_id));
+      DebugLog.println(uri);
     }
 
-    bool is_successful = writeUri(uri_protocol_id, uri_message);
+    ndef_length = encodeUriMessage(protocol_id, uri, ndef_message);
 
-    if(!is_successful) {
-      if(debug_mode) {
-        Serial1.println("Writing URI unsuccessful.");
+    if(writing_target == TARGET_MAILBOX) {
+      if(!mailbox_enabled) {
+        finishWrite(JOB_ERROR);
+        return;
       }
 
-      output_byte = 'E';
-      digitalWrite(ERROR_LED_PIN, HIGH);
+      // Cheap to write, and empty once a phone has read it, so it's always written
+      write_step = STEP_MAILBOX;
     } else {
-      if(debug_mode) {
-        Serial1.println("Writing URI successful.");
+      bool header_dirty = false;
+      bool body_dirty = false;
+
+      for(uint16_t offset = 0; offset < ndef_length; offset += 4) {
+        if(blockDirty(offset)) {
+          if(offset < NDEF_HEADER_SIZE) {
+            header_dirty = true;
+          } else {
+            body_dirty = true;
+          }
+        }
+      }
+
+      if(!header_dirty && !body_dirty) {
+        if(debug_mode) {
+          DebugLog.println("URI already on the tag.");
+        }
+
+        finishWrite(JOB_OK);
+        return;
+      }
+
+      if(!body_dirty) {
+        // Changing only the header can't mix two URIs
+        write_step = STEP_HEADER;
+      } else if(ndef_shadow_valid >= 4 && memcmp(ndef_shadow, empty_ndef_message, 4) == 0) {
+        // Already empty, e.g. after a deferred write
+        write_step = STEP_BODY;
+      } else {
+        write_step = STEP_INVALIDATE;
       }
 
-      output_byte = 'K';
-      digitalWrite(ERROR_LED_PIN, LOW);
+      write_offset = NDEF_HEADER_SIZE;
     }
 
+    noInterrupts();
+
+    WriteJob &job = write_jobs[job_id % WRITE_JOB_HISTORY];
+
+    if(job.id == job_id) {
+      job.status = JOB_WRITING;
+    }
+
+    interrupts();
+
+    digitalWrite(ACTIVE_LED_PIN, HIGH);
+  }
+
+  if(micros() - write_started_at > NFC_WRITE_TIMEOUT * 1000UL) {
     if(debug_mode) {
-      Serial1.print("Assigning new URI (");
-      Serial1.print(uri_message);
-      Serial1.print(") to previous URI (prev_uri now equals ");
-      Serial1.print(previous_uri);
-      Serial1.println(")...");
+      DebugLog.println("Writing URI timed out.");
+    }
+
+    finishWrite(JOB_ERROR);
+    return;
+  }
+
+  if(writing_target == TARGET_EEPROM && rf_field_present) {
+    requeueWrite();
+    return;
+  }
+
+  // The tag doesn't acknowledge its address while programming the previous chunk
+  if(!nfcReady(NFC_USER_ADDRESS)) {
+    return;
+  }
+
+  bool is_successful = true;
+
+  if(write_step == STEP_MAILBOX) {
+    if(writeMailbox(ndef_message, ndef_length)) {
+      finishWrite(JOB_OK);
+      return;
+    }
+
+    is_successful = false;
+  } else if(write_step == STEP_INVALIDATE) {
+    is_successful = writeTag(0, empty_ndef_message, 4);
+
+    if(is_successful) {
+      write_step = STEP_BODY;
+    }
+  } else if(write_step == STEP_BODY) {
+    while(write_offset < ndef_length && !blockDirty(write_offset)) {
+      write_offset += 4;
+    }
+
+    if(write_offset < ndef_length) {
+      uint16_t length = 4;
+
+      // Neighbouring changed blocks go into the same chunk
+      while(
+        length < NFC_WRITE_CHUNK &&
+        write_offset + length < ndef_length &&
+        blockDirty(write_offset + length)
+      ) {
+        length += 4;
+      }
+
+      is_successful = writeTag(write_offset, ndef_message + write_offset, length);
+
+      if(is_successful) {
+        write_offset += length;
+      }
+    } else {
+      write_step = STEP_HEADER;
+    }
+  }
+
+  if(write_step == STEP_HEADER) {
+    is_successful = writeTag(0, ndef_message, NDEF_HEADER_SIZE);
+
+    if(is_successful) {
+      write_step = STEP_DONE;
+    }
+  } else if(write_step == STEP_DONE) {
+    finishWrite(JOB_OK);
+    return;
+  }
+
+  if(!is_successful) {
+    // The tag is busy answering a phone, which the GPO interrupt might not have reported yet
+    if(rf_field_present || gpo_pending) {
+      if(writing_target == TARGET_EEPROM) {
+        requeueWrite();
+      }
+
+      // The mailbox is tried again on the next pass
+      return;
+    }
+
+    finishWrite(JOB_ERROR);
+  }
+}
+
+// Puts the job being written back, it's written once the phone has left the field
+void requeueWrite() {
+  noInterrupts();
+
+  WriteJob &job = write_jobs[writing_job_id % WRITE_JOB_HISTORY];
+  char status = JOB_DEFERRED;
+
+  // Unless a newer URI has been staged meanwhile
+  if(staged_job_ids[TARGET_EEPROM] == 0) {
+    staged_job_ids[TARGET_EEPROM] = writing_job_id;
+    staged_indexes[TARGET_EEPROM] = writing_index;
+  } else {
+    status = JOB_SUPERSEDED;
+  }
+
+  if(job.id == writing_job_id) {
+    job.status = status;
+  }
+
+  interrupts();
+
+  if(debug_mode) {
+    DebugLog.print("Job ");
+    DebugLog.print(writing_job_id);
+    DebugLog.println(status == JOB_DEFERRED ? " deferred, phone in the field." : " superseded while deferred.");
+  }
+
+  writing_job_id = 0;
+  write_step = STEP_DONE;
+  digitalWrite(ACTIVE_LED_PIN, LOW);
+}
+
+void finishWrite(char status) {
+  uint32_t now = micros();
+
+  if(status == JOB_OK) {
+    // Every block of the message is on the tag now, the ones the shadow didn't know were written
+    if(writing_target == TARGET_EEPROM && ndef_shadow_valid < ndef_length) {
+      ndef_shadow_valid = ndef_length;
     }
 
-    strcpy(previous_uri, uri_message);
+    output_byte = 'K';
+    digitalWrite(ERROR_LED_PIN, LOW);
+    raiseAttention(ATTENTION_WRITE_OK);
+  } else {
+    // Part of the message might have been written, the next one is written whole
+    if(writing_target == TARGET_EEPROM) {
+      ndef_shadow_valid = 0;
+    }
 
+    output_byte = 'E';
+    digitalWrite(ERROR_LED_PIN, HIGH);
+    raiseAttention(ATTENTION_WRITE_ERROR);
+  }
+
+  noInterrupts();
+
+  // The slot is reused by a newer job after WRITE_JOB_HISTORY writes
+  WriteJob &job = write_jobs[writing_job_id % WRITE_JOB_HISTORY];
+
+  if(job.id == writing_job_id) {
+    job.status = status;
+    job.latency = now - job.received_at;
+    job.write_time = now - write_started_at;
+    job.bytes_written = write_bytes;
+  }
+
+  if(status == JOB_OK && write_bytes > 0) {
+    WriteBenchmark &benchmark = write_benchmarks[writing_target];
+
+    benchmark.count++;
+    benchmark.last = now - write_started_at;
+    benchmark.total += benchmark.last;
+
+    if(benchmark.last > benchmark.max) {
+      benchmark.max = benchmark.last;
+    }
+  }
+
+  interrupts();
+
+  if(debug_mode) {
+    DebugLog.print("Job ");
+    DebugLog.print(writing_job_id);
+    DebugLog.print(status == JOB_OK ? " written (" : " failed (");
+    DebugLog.print(write_bytes);
+    DebugLog.print(" bytes) in ");
+    DebugLog.print(now - write_started_at);
+    DebugLog.println(" us.");
+  }
+
+  writing_job_id = 0;
+  write_step = STEP_DONE;
+  digitalWrite(ACTIVE_LED_PIN, LOW);
+}
+
+// Single short URI record, padded with zeros to whole 4 byte blocks
+uint16_t encodeUriMessage(byte protocol_id, const char *uri, byte *message) {
+  size_t uri_length = strlen(uri);
+  uint16_t length = 0;
+
+  message[length++] = 0x03; // NDEF message TLV
+  message[length++] = (byte) (uri_length + 5);
+  message[length++] = 0xD1; // Message begin, message end, short record, well-known type
+  message[length++] = 0x01; // Type length
+  message[length++] = (byte) (uri_length + 1); // Payload length
+  message[length++] = 'U';
+  message[length++] = protocol_id;
+
+  memcpy(message + length, uri, uri_length);
+  length += uri_length;
+
+  message[length++] = 0xFE; // Terminator TLV
+
+  while(length % 4 != 0) {
+    message[length++] = 0x00;
+  }
+
+  return length;
+}
+
+bool nfcReady(byte device) {
+  WireNFC.beginTransmission(device);
+
+  return WireNFC.endTransmission() == 0;
+}
+
+// Only used in setup()
+bool waitForNfc(byte device) {
+  uint32_t start = millis();
+
+  while(!nfcReady(device)) {
+    if(millis() - start > NFC_WRITE_TIMEOUT) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Reading more than NFC_WRITE_CHUNK bytes after setup() would grow the I2C receive buffer
+bool readNfc(byte device, uint16_t address, byte *data, byte length) {
+  WireNFC.beginTransmission(device);
+  WireNFC.write((byte) (address >> 8));
+  WireNFC.write((byte) address);
+
+  if(WireNFC.endTransmission(false) != 0 || WireNFC.requestFrom(device, length) != length) {
+    return false;
+  }
+
+  for(byte i = 0; i < length; i++) {
+    data[i] = WireNFC.read();
+  }
+
+  return true;
+}
+
+bool writeNfc(byte device, uint16_t address, const byte *data, uint16_t length) {
+  WireNFC.beginTransmission(device);
+  WireNFC.write((byte) (address >> 8));
+  WireNFC.write((byte) address);
+  WireNFC.write(data, length);
+
+  if(WireNFC.endTransmission() != 0) {
     if(debug_mode) {
-      Serial1.print("Assigned new URI to previous URI (prev_uri now equals ");
-      Serial1.print(previous_uri);
-      Serial1.println(").");
+      DebugLog.print("NFC tag rejected write at address 0x");
+      DebugLog.println(address, 16);
     }
 
-    previous_uri_protocol_id = uri_protocol_id;
+    return false;
   }
+
+  return true;
 }
 
-bool writeUri(byte protocol_id, String uri) {
-  digitalWrite(ACTIVE_LED_PIN, HIGH);
+// Offset and length are multiples of 4, within the first NDEF_MESSAGE_SIZE bytes of the NDEF area
+bool blockDirty(uint16_t offset) {
+  return offset >= ndef_shadow_valid || memcmp(ndef_message + offset, ndef_shadow + offset, 4) != 0;
+}
 
-  bool is_successful = true;
+bool writeTag(uint16_t offset, const byte *data, uint16_t length) {
+  if(!writeNfc(NFC_USER_ADDRESS, ndef_address + offset, data, length)) {
+    return false;
+  }
+
+  memcpy(ndef_shadow + offset, data, length);
+  write_bytes += length;
+
+  return true;
+}
+
+// Only used in setup()
+bool readTag(uint16_t offset, byte *data, uint16_t length) {
+  for(uint16_t i = 0; i < length; i += NFC_WRITE_CHUNK) {
+    byte chunk = length - i < NFC_WRITE_CHUNK ? length - i : NFC_WRITE_CHUNK;
+
+    if(!readNfc(NFC_USER_ADDRESS, ndef_address + offset + i, data + i, chunk)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Formatted by st25dv.begin() if it wasn't already
+bool readCapabilityContainer() {
+  byte container[8];
+
+  if(!readNfc(NFC_USER_ADDRESS, 0x0000, container, 8)) {
+    return false;
+  }
+
+  // Magic number
+  if(container[0] != 0xE1 && container[0] != 0xE2) {
+    return false;
+  }
+
+  // Memory size in 8 byte units, 0 if it's in the 8 byte container
+  if(container[2] != 0) {
+    ndef_address = 4;
+    ndef_area_size = container[2] * 8;
+  } else {
+    ndef_address = 8;
+    ndef_area_size = ((container[6] << 8) | container[7]) * 8;
+  }
+
+  return true;
+}
+
+// Validation code 0x09 presents the password, 0x07 changes it (only in an open session)
+bool presentPassword(const byte *password, byte code) {
+  byte presentation[17];
+
+  // Password, validation code, password again
+  memcpy(presentation, password, 8);
+  presentation[8] = code;
+  memcpy(presentation + 9, password, 8);
+
+  return writeNfc(NFC_SYSTEM_ADDRESS, NFC_I2C_PWD_REGISTER, presentation, 17);
+}
+
+// The I2C security session is needed to change the static configuration
+bool openSession(const byte *password) {
+  byte session;
+
+  return
+    presentPassword(password, 0x09) &&
+    readNfc(NFC_USER_ADDRESS, NFC_I2C_SSO_REGISTER, &session, 1) &&
+    (session & 0x01);
+}
+
+// The session stays open until a wrong password is presented, so it's closed right after configuring
+bool closeSession() {
+  byte wrong_password[8];
+
+  for(byte i = 0; i < 8; i++) {
+    wrong_password[i] = ~nfc_i2c_password[i];
+  }
+
+  byte session;
+
+  // The tag may not acknowledge a wrong password, only the session status tells
+  presentPassword(wrong_password, 0x09);
+
+  return readNfc(NFC_USER_ADDRESS, NFC_I2C_SSO_REGISTER, &session, 1) && !(session & 0x01);
+}
+
+// Only used in setup(), a tag still on the factory password gets NFC_I2C_PASSWORD
+bool provisionPassword() {
+  if(openSession(nfc_i2c_password)) {
+    return closeSession();
+  }
+
+  if(memcmp(nfc_i2c_password, nfc_factory_password, 8) == 0 || !openSession(nfc_factory_password)) {
+    return false;
+  }
+
+  bool is_written =
+    presentPassword(nfc_i2c_password, 0x07) &&
+    waitForNfc(NFC_SYSTEM_ADDRESS);
+
+  if(debug_mode) {
+    DebugLog.println(is_written ? "Changed the NFC I2C password from the factory default." : "Couldn't change the NFC I2C password.");
+  }
+
+  return closeSession() && is_written;
+}
+
+// GPO pin goes low when the RF field changes, on RF activity and when a phone reads the mailbox
+bool configureGpo() {
+  byte gpo;
+  byte wanted = NFC_GPO_ENABLED | NFC_GPO_FIELD_CHANGE | NFC_GPO_RF_ACTIVITY;
+
+#if NFC_MAILBOX
+  wanted |= NFC_GPO_RF_GET_MSG;
+#endif
+
+  if(!readNfc(NFC_SYSTEM_ADDRESS, NFC_GPO_REGISTER, &gpo, 1)) {
+    return false;
+  }
+
+  // Static configuration is in EEPROM too, so it's only written if it differs
+  if(gpo != wanted) {
+    bool is_written =
+      openSession(nfc_i2c_password) &&
+      writeNfc(NFC_SYSTEM_ADDRESS, NFC_GPO_REGISTER, &wanted, 1) &&
+      waitForNfc(NFC_SYSTEM_ADDRESS);
+
+    if(!closeSession() || !is_written) {
+      return false;
+    }
+  }
+
+  byte field;
+  byte status;
+
+  // Reading the status clears it
+  if(
+    !readNfc(NFC_USER_ADDRESS, NFC_EH_CTRL_REGISTER, &field, 1) ||
+    !readNfc(NFC_USER_ADDRESS, NFC_IT_STS_REGISTER, &status, 1)
+  ) {
+    return false;
+  }
+
+  rf_field_present = field & NFC_EH_FIELD_ON;
+
+  // Open-drain output
+  pinMode(NFC_GPO_PIN, INPUT_PULLUP);
+  attachInterrupt(NFC_GPO_PIN, gpoEvent, FALLING);
+
+  return true;
+}
+
+// WireNFC can't be used in an interrupt, the status is read from loop()
+void gpoEvent() {
+  if(!gpo_pending) {
+    gpo_pending_at = millis();
+    gpo_pending = true;
+  }
+
+  loop_work_pending = true;
+}
+
+void handleGpo() {
+  // Busy programming or answering a phone, tried again on the next pass
+  if(!gpo_pending || !nfcReady(NFC_USER_ADDRESS)) {
+    return;
+  }
+
+  // Edges from now on are seen the next time
+  noInterrupts();
+
+  uint32_t timestamp = gpo_pending_at;
+  gpo_pending = false;
+
+  interrupts();
 
-  String protocol_string = protocolIdToString(protocol_id);
+  byte status;
+  byte field;
+
+  if(
+    !readNfc(NFC_USER_ADDRESS, NFC_IT_STS_REGISTER, &status, 1) ||
+    !readNfc(NFC_USER_ADDRESS, NFC_EH_CTRL_REGISTER, &field, 1)
+  ) {
+    noInterrupts();
+
+    if(!gpo_pending) {
+      gpo_pending_at = timestamp;
+      gpo_pending = true;
+    }
+
+    interrupts();
+    return;
+  }
 
   if(debug_mode) {
-    Serial1.print("Attempting to write URI: ");
-    Serial1.print(protocol_string);
-    Serial1.println(uri);
+    DebugLog.print("NFC interrupt status 0x");
+    DebugLog.print(status, 16);
+    DebugLog.print(", field 0x");
+    DebugLog.println(field, 16);
   }
 
-  int result = st25dv.writeURI(protocol_string.c_str(), uri, "");
+  // Several can be set after a short tap, in the order they happened
+  if((status & NFC_IT_FIELD_FALLING) && rf_field_present) {
+    rf_field_present = false;
+    pushEvent(EVENT_FIELD_OFF, timestamp);
+  }
+
+  if((status & NFC_IT_FIELD_RISING) && !rf_field_present) {
+    rf_field_present = true;
+    tag_read_reported = false;
+    pushEvent(EVENT_FIELD_ON, timestamp);
+  }
+
+  // A read is many RF commands, only the first one is reported
+  if((status & NFC_IT_RF_ACTIVITY) && !tag_read_reported) {
+    tag_read_reported = true;
+    pushEvent(EVENT_TAG_READ, timestamp);
+  }
+
+  if(status & NFC_IT_RF_GET_MSG) {
+    pushEvent(EVENT_MAILBOX_READ, timestamp);
+  }
+
+  // An edge can be missed while the status is read
+  bool field_on = field & NFC_EH_FIELD_ON;
+
+  if(field_on != rf_field_present) {
+    rf_field_present = field_on;
+    tag_read_reported = tag_read_reported && field_on;
+    pushEvent(field_on ? EVENT_FIELD_ON : EVENT_FIELD_OFF, timestamp);
+  }
+}
+
+void pushEvent(uint8_t type, uint32_t timestamp) {
+  uint8_t next_head = (event_head + 1) & (EVENT_QUEUE_SIZE - 1);
+
+  // Newest events are dropped when full, the host sees how many
+  if(next_head == event_tail) {
+    events_dropped++;
+    raiseAttention(ATTENTION_RF_EVENTS_DROPPED);
+    return;
+  }
+
+  events[event_head].type = type;
+  events[event_head].timestamp = timestamp;
+
+  // Event has to be written before the consumer can see it
+  __DMB();
+  event_head = next_head;
+
+  raiseAttention(ATTENTION_RF_EVENT);
 
   if(debug_mode) {
-    Serial1.print("Result: ");
-    Serial1.println(
-      String(result) +
-      String(" - ") +
-      resultToString(result)
-    );
+    DebugLog.print("RF event 0x");
+    DebugLog.print(type, 16);
+    DebugLog.print(" at ");
+    DebugLog.println(timestamp);
   }
+}
 
-  if(result > 0) {
-    is_successful = false;
+// Fast transfer mode has to be allowed in the static configuration, which needs an I2C security session.
+// The mailbox watchdog is turned off, so a session URI waits for the phone however long it takes.
+bool enableMailbox() {
+  byte mode;
+  byte watchdog;
+
+  if(
+    !readNfc(NFC_SYSTEM_ADDRESS, NFC_MB_MODE_REGISTER, &mode, 1) ||
+    !readNfc(NFC_SYSTEM_ADDRESS, NFC_MB_WDG_REGISTER, &watchdog, 1)
+  ) {
+    return false;
   }
 
-  digitalWrite(ACTIVE_LED_PIN, LOW);
+  // Static configuration is in EEPROM too, so it's only written if it differs
+  if((mode & 0x01) == 0 || watchdog != 0x00) {
+    const byte enabled = 0x01;
+    const byte disabled = 0x00;
+
+    bool is_written =
+      openSession(nfc_i2c_password) &&
+      writeNfc(NFC_SYSTEM_ADDRESS, NFC_MB_MODE_REGISTER, &enabled, 1) &&
+      waitForNfc(NFC_SYSTEM_ADDRESS) &&
+      writeNfc(NFC_SYSTEM_ADDRESS, NFC_MB_WDG_REGISTER, &disabled, 1) &&
+      waitForNfc(NFC_SYSTEM_ADDRESS);
+
+    if(!closeSession() || !is_written) {
+      return false;
+    }
+  }
+
+  const byte enabled = 0x01;
+
+  return writeNfc(NFC_USER_ADDRESS, NFC_MB_CTRL_REGISTER, &enabled, 1);
+}
+
+// A message can only be put into an empty mailbox, turning it off and on again empties it.
+// The message has to be written in one go.
+bool writeMailbox(const byte *message, uint16_t length) {
+  const byte disabled = 0x00;
+  const byte enabled = 0x01;
+
+  if(
+    !writeNfc(NFC_USER_ADDRESS, NFC_MB_CTRL_REGISTER, &disabled, 1) ||
+    !writeNfc(NFC_USER_ADDRESS, NFC_MB_CTRL_REGISTER, &enabled, 1) ||
+    !writeNfc(NFC_USER_ADDRESS, NFC_MAILBOX_ADDRESS, message, length)
+  ) {
+    return false;
+  }
+
+  write_bytes += length;
 
-  return is_successful;
+  return true;
 }
 
 void requestEvent() {
+  recordWakeLatency();
+
+  if(read_mode == READ_ATTENTION) {
+    read_mode = READ_STATUS;
+
+    writeAttention();
+    return;
+  }
+
+  if(read_mode == READ_IDLE_STATS) {
+    read_mode = READ_STATUS;
+
+    writeIdleStats();
+    return;
+  }
+
+  if(read_mode == READ_RECEIVE_TIMING) {
+    read_mode = READ_STATUS;
+
+    writeReceiveTiming();
+    return;
+  }
+
+  if(read_mode == READ_WRITE_JOB) {
+    read_mode = READ_STATUS;
+
+    writeWriteJob();
+    return;
+  }
+
+  if(read_mode == READ_WRITE_BENCHMARK) {
+    read_mode = READ_STATUS;
+
+    writeBenchmarks();
+    return;
+  }
+
+  if(read_mode == READ_RF_EVENTS) {
+    read_mode = READ_STATUS;
+
+    writeEvents();
+    return;
+  }
+
   WirePeripheral.write(output_byte);
 
   output_byte = '\0';
 
   if(debug_mode) {
-    Serial1.println("Responded to I2C request from controller.");
+    DebugLog.println("Responded to I2C request from controller.");
   }
 }
 
+// Runs in the I2C interrupt, so it only uses fixed buffers and takes bounded time
 void receiveEvent(int howMany) {
+  uint32_t start_cycles = DWT->CYCCNT;
+
+  recordWakeLatency();
+
+  // New URI is written from loop()
+  loop_work_pending = true;
+
   if(debug_mode) {
-    Serial1.print("Receiving ");
-    Serial1.print(howMany);
-    Serial1.println(" bytes from controller.");
+    DebugLog.print("Receiving ");
+    DebugLog.print(howMany);
+    DebugLog.println(" bytes from controller.");
   }
 
-  String input = "";
+  char input[URI_MAX_LENGTH + 1];
+  size_t input_length = 0;
+  bool input_overflow = false;
   uint8_t command = '\0';
+  byte protocol_id = 0x00;
   bool command_set = false;
   bool protocol_set = false;
   bool protocol_error = false;
@@ -227,14 +1182,15 @@ void receiveEvent(int howMany) {
     char c = WirePeripheral.read();
 
     if(debug_mode) {
-      Serial1.print("Received byte (0x");
-      Serial1.print(c, 16);
-      Serial1.println(") from controller.");
+      DebugLog.print("Received byte (0x");
+      DebugLog.print(c, 16);
+      DebugLog.println(") from controller.");
     }
 
-    if(c == 0) {
+    // Attention mask can be 0x00
+    if(c == 0 && (!command_set || command == 0x02 || command == 0x08)) {
       if(debug_mode) {
-        Serial1.println("Received 0x00 byte. Skipping");
+        DebugLog.println("Received 0x00 byte. Skipping");
       }
       
       continue;
@@ -244,74 +1200,162 @@ void receiveEvent(int howMany) {
       command = c;
 
       if(debug_mode) {
-        Serial1.print("Received command (0x");
-        Serial1.print(command, 16);
-        Serial1.println(") from controller.");
+        DebugLog.print("Received command (0x");
+        DebugLog.print(command, 16);
+        DebugLog.println(") from controller.");
       }
 
       command_set = true;
-    } else {
-      if(!protocol_set) {
-        String protocol = protocolIdToString(c);
-
-        if(protocol.length() == 0) {
-          protocol_error = true;
+    } else if((command == 0x02 || command == 0x08) && !protocol_set) {
+      if(uriPrefix(c) == nullptr) {
+        protocol_error = true;
 
-          if(debug_mode) {
-            Serial1.print("Unknown protocol: 0x");
-            Serial1.println(c, 16);
-          }
-        } else {
-          uri_protocol_id = (byte) c;
+        if(debug_mode) {
+          DebugLog.print("Unknown protocol: 0x");
+          DebugLog.println(c, 16);
         }
-
-        protocol_set = true;
       } else {
-        input += c;
+        protocol_id = (byte) c;
       }
+
+      protocol_set = true;
+    } else if(input_length < URI_MAX_LENGTH) {
+      input[input_length++] = c;
+    } else {
+      // Still drained, so the next message starts clean
+      input_overflow = true;
     }
   }
 
+  input[input_length] = '\0';
+
   switch(command) {
     case 0x00: // Skip 0
       break;
     case 0x01: // Heartbeat
       if(debug_mode) {
-        Serial1.println("Received heartbeat from controller.");
+        DebugLog.println("Received heartbeat from controller.");
       }
 
       last_heartbeat = millis();
       break;
     case 0x02: // Write URL
+    case 0x08: // Write session URL to the mailbox
       if(debug_mode) {
-        Serial1.println("Received write URL command from controller.");
+        DebugLog.print("Received write URL command (0x");
+        DebugLog.print(command, 16);
+        DebugLog.println(") from controller.");
       }
 
-      if(protocol_error) {
+      if(protocol_error || !protocol_set || input_overflow) {
         if(debug_mode) {
-          Serial1.println("There has been a protocol error.");
+          if(input_overflow) {
+            DebugLog.print("URI longer than ");
+            DebugLog.print(URI_MAX_LENGTH);
+            DebugLog.println(" bytes.");
+          } else {
+            DebugLog.println("There has been a protocol error.");
+          }
         }
 
-        output_byte = 'E';
-        digitalWrite(ERROR_LED_PIN, HIGH);
-      } else {
-        strcpy(uri_message, input.c_str());
+        rejectWrite();
+        break;
+      }
+
+      if(debug_mode) {
+        DebugLog.print("Received protocol (0x");
+        DebugLog.print(protocol_id, 16);
+        DebugLog.print(") followed by text (");
+        DebugLog.print(input);
+        DebugLog.println(") from controller.");
+      }
+
+      stageWrite(command == 0x08 ? TARGET_MAILBOX : TARGET_EEPROM, protocol_id, input, input_length);
+      break;
+    case 0x03: // Set attention mask
+      if(input_length != 1 || input_overflow) {
+        if(debug_mode) {
+          DebugLog.println("Attention mask has to be 1 byte long.");
+        }
+
+        break;
+      }
+
+      noInterrupts();
+      attention_mask = (byte) input[0];
+      updateAttentionPin();
+      interrupts();
+
+      if(debug_mode) {
+        DebugLog.print("Set attention mask to 0x");
+        DebugLog.println(attention_mask, 16);
+      }
+      break;
+    case 0x04: // Read attention
+      read_mode = READ_ATTENTION;
+
+      if(debug_mode) {
+        DebugLog.println("Next read will return attention reasons.");
+      }
+      break;
+    case 0x05: // Read idle statistics
+      read_mode = READ_IDLE_STATS;
+
+      if(debug_mode) {
+        DebugLog.println("Next read will return idle statistics.");
+      }
+      break;
+    case 0x06: // Read receive timing
+      read_mode = READ_RECEIVE_TIMING;
 
+      if(debug_mode) {
+        DebugLog.println("Next read will return receive timing.");
+      }
+      break;
+    case 0x07: // Read write job
+      if(input_length != 1 || input_overflow) {
         if(debug_mode) {
-          Serial1.print("Received protocol (0x");
-          Serial1.print(uri_protocol_id, 16);
-          Serial1.print(") followed by text (");
-          Serial1.print(input);
-          Serial1.println(") from controller.");
+          DebugLog.println("Write job ID has to be 1 byte long.");
         }
+
+        break;
+      }
+
+      // 0x00 is the latest job
+      requested_job_id = input[0] == 0 ? last_job_id : (byte) input[0];
+      read_mode = READ_WRITE_JOB;
+
+      if(debug_mode) {
+        DebugLog.print("Next read will return write job ");
+        DebugLog.println(requested_job_id);
+      }
+      break;
+    case 0x09: // Read write benchmark
+      read_mode = READ_WRITE_BENCHMARK;
+
+      if(debug_mode) {
+        DebugLog.println("Next read will return write benchmarks.");
+      }
+      break;
+    case 0x0A: // Read RF events
+      read_mode = READ_RF_EVENTS;
+
+      if(debug_mode) {
+        DebugLog.println("Next read will return RF events.");
       }
       break;
     default:
       if(debug_mode) {
-        Serial1.print("Unknown command: 0x");
-        Serial1.println(command, 16);
+        DebugLog.print("Unknown command: 0x");
+        DebugLog.println(command, 16);
       }
-  }  
+  }
+
+  receive_cycles = DWT->CYCCNT - start_cycles;
+
+  if(receive_cycles > receive_cycles_max) {
+    receive_cycles_max = receive_cycles;
+  }
 }
 
 void heartbeatEvent() {
@@ -319,13 +1363,13 @@ void heartbeatEvent() {
 
   if(diff > HB_TIMEOUT) {
     if(debug_mode && !heartbeat_disable_reset_on_arrest) {
-      Serial1.println("Heartbeat arrest.");
+      DebugLog.println("Heartbeat arrest.");
     }
 
     if(!heartbeat_disable_reset_on_arrest) {
       if(debug_mode) {
-        Serial1.println("Resetting...");
-        delay(50);
+        DebugLog.println("Resetting...");
+        DebugLog.flush();
       }
 
       digitalWrite(ERROR_LED_PIN, HIGH);
@@ -334,98 +1378,272 @@ void heartbeatEvent() {
   }
 }
 
-String protocolIdToString(byte protocol) {
-  switch(protocol) {
-    case 0x01:
-      return URI_ID_0x01_STRING;
-    case 0x02:
-      return URI_ID_0x02_STRING;
-    case 0x03:
-      return URI_ID_0x03_STRING;
-    case 0x04:
-      return URI_ID_0x04_STRING;
-    case 0x05:
-      return URI_ID_0x05_STRING;
-    case 0x06:
-      return URI_ID_0x06_STRING;
-    case 0x07:
-      return URI_ID_0x07_STRING;
-    case 0x08:
-      return URI_ID_0x08_STRING;
-    case 0x09:
-      return URI_ID_0x09_STRING;
-    case 0x0A:
-      return URI_ID_0x0A_STRING;
-    case 0x0B:
-      return URI_ID_0x0B_STRING;
-    case 0x0C:
-      return URI_ID_0x0C_STRING;
-    case 0x0D:
-      return URI_ID_0x0D_STRING;
-    case 0x0E:
-      return URI_ID_0x0E_STRING;
-    case 0x0F:
-      return URI_ID_0x0F_STRING;
-    case 0x10:
-      return URI_ID_0x10_STRING;
-    case 0x11:
-      return URI_ID_0x11_STRING;
-    case 0x12:
-      return URI_ID_0x12_STRING;
-    case 0x13:
-      return URI_ID_0x13_STRING;
-    case 0x14:
-      return URI_ID_0x14_STRING;
-    case 0x15:
-      return URI_ID_0x15_STRING;
-    case 0x16:
-      return URI_ID_0x16_STRING;
-    case 0x17:
-      return URI_ID_0x17_STRING;
-    case 0x18:
-      return URI_ID_0x18_STRING;
-    case 0x19:
-      return URI_ID_0x19_STRING;
-    case 0x1A:
-      return URI_ID_0x1A_STRING;
-    case 0x1B:
-      return URI_ID_0x1B_STRING;
-    case 0x1C:
-      return URI_ID_0x1C_STRING;
-    case 0x1D:
-      return URI_ID_0x1D_STRING;
-    case 0x1E:
-      return URI_ID_0x1E_STRING;
-    case 0x1F:
-      return URI_ID_0x1F_STRING;
-    case 0x20:
-      return URI_ID_0x20_STRING;
-    case 0x21:
-      return URI_ID_0x21_STRING;
-    case 0x22:
-      return URI_ID_0x22_STRING;
-    case 0x23:
-      return URI_ID_0x23_STRING;
-    default:
-      return "";
-  }
-}
-
-String resultToString(int result) {
-  switch(result) {
-    case NDEF_OK:
-      return "NDEF_OK";
-    case NDEF_ERROR:
-      return "NDEF_ERROR";
-    case NDEF_ERROR_MEMORY_TAG:
-      return "NDEF_ERROR_MEMORY_TAG";
-    case NDEF_ERROR_MEMORY_INTERNAL:
-      return "NDEF_ERROR_MEMORY_INTERNAL";
-    case NDEF_ERROR_LOCKED:
-      return "NDEF_ERROR_LOCKED";
-    case NDEF_ERROR_NOT_FORMATED:
-      return "NDEF_ERROR_NOT_FORMATED";
-    default:
-      return "Unknown";
+// Safe to call from any context, also with interrupts disabled
+void raiseAttention(byte reason) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  attention_reasons |= reason;
+  updateAttentionPin();
+
+  __set_PRIMASK(primask);
+}
+
+void updateAttentionPin() {
+  digitalWriteFast(digitalPinToPinName(ATTENTION_PIN), (attention_reasons & attention_mask) ? LOW : HIGH);
+}
+
+// Sleeps until the next interrupt, SysTick wakes it up at least every millisecond
+void idleSleep() {
+  // Interrupts are only masked, one arriving between the check and __WFI() still wakes it up
+  __disable_irq();
+
+  if(loop_work_pending) {
+    loop_work_pending = false;
+    __enable_irq();
+    return;
+  }
+
+  uint32_t sleep_start = sleepMicros();
+
+  __DSB();
+  __WFI();
+
+  idle_window_micros += sleepMicros() - sleep_start;
+  idle_window_wakes++;
+
+  wake_cycles = DWT->CYCCNT;
+  wake_pending = true;
+
+  // The interrupt that woke it up runs now
+  __enable_irq();
+
+  wake_pending = false;
+
+  uint32_t window = millis() - idle_window_start;
+
+  if(window >= IDLE_STATS_WINDOW) {
+    // Microseconds per millisecond
+    idle_permille = idle_window_micros / window > 1000 ? 1000 : idle_window_micros / window;
+    idle_wakes = idle_window_wakes;
+
+    idle_window_start += window;
+    idle_window_micros = 0;
+    idle_window_wakes = 0;
+  }
+}
+
+// micros() misses a SysTick interrupt that is pending while interrupts are masked
+uint32_t sleepMicros() {
+  uint32_t ticks = HAL_GetTick();
+  uint32_t value = SysTick->VAL;
+
+  if(SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+    ticks++;
+    value = SysTick->VAL;
+  }
+
+  uint32_t load = SysTick->LOAD + 1;
+
+  return ticks * 1000 + (load - value) * 1000 / load;
+}
+
+// Called first thing in I2C callbacks
+void recordWakeLatency() {
+  if(!wake_pending) {
+    return;
+  }
+
+  wake_pending = false;
+  wake_latency = DWT->CYCCNT - wake_cycles;
+
+  if(wake_latency > wake_latency_max) {
+    wake_latency_max = wake_latency;
+  }
+}
+
+void writeIdleStats() {
+  WirePeripheral.write((byte) (idle_permille >> 8));
+  WirePeripheral.write((byte) idle_permille);
+  writeUint32(idle_wakes);
+  writeUint32(wake_latency);
+  writeUint32(wake_latency_max);
+
+  if(debug_mode) {
+    DebugLog.println("Responded to I2C request from controller with idle statistics.");
+  }
+}
+
+// Called from receiveEvent(), the URI is written from loop()
+void stageWrite(byte target, byte protocol_id, const char *uri, size_t length) {
+  WriteJob &job = newWriteJob();
+  byte other_target = target == TARGET_EEPROM ? TARGET_MAILBOX : TARGET_EEPROM;
+  byte index = 0;
+
+  // Only the latest URI is worth writing
+  if(staged_job_ids[target] != 0) {
+    WriteJob &superseded = write_jobs[staged_job_ids[target] % WRITE_JOB_HISTORY];
+
+    if(superseded.id == staged_job_ids[target]) {
+      superseded.status = JOB_SUPERSEDED;
+    }
+
+    index = staged_indexes[target];
+  } else {
+    // One of the 3 buffers is neither being written nor staged for the other target
+    while(index == writing_index || (staged_job_ids[other_target] != 0 && index == staged_indexes[other_target])) {
+      index++;
+    }
+  }
+
+  memcpy(staged_uris[index], uri, length + 1);
+  staged_protocol_ids[index] = protocol_id;
+  staged_indexes[target] = index;
+  staged_job_ids[target] = job.id;
+  job.status = JOB_QUEUED;
+
+  if(debug_mode) {
+    DebugLog.print("Staged URI as job ");
+    DebugLog.println(job.id);
+  }
+}
+
+void rejectWrite() {
+  WriteJob &job = newWriteJob();
+
+  job.status = JOB_ERROR;
+
+  output_byte = 'E';
+  digitalWrite(ERROR_LED_PIN, HIGH);
+  raiseAttention(ATTENTION_WRITE_ERROR);
+}
+
+WriteJob &newWriteJob() {
+  last_job_id = last_job_id == 255 ? 1 : last_job_id + 1;
+
+  WriteJob &job = write_jobs[last_job_id % WRITE_JOB_HISTORY];
+
+  job.id = last_job_id;
+  job.received_at = micros();
+  job.latency = 0;
+  job.write_time = 0;
+  job.bytes_written = 0;
+
+  return job;
+}
+
+void writeWriteJob() {
+  const WriteJob &job = write_jobs[requested_job_id % WRITE_JOB_HISTORY];
+  bool known = requested_job_id != 0 && job.id == requested_job_id;
+
+  WirePeripheral.write(requested_job_id);
+  WirePeripheral.write(known ? job.status : JOB_UNKNOWN);
+  writeUint32(known ? job.latency : 0);
+  writeUint32(known ? job.write_time : 0);
+  WirePeripheral.write((byte) (known ? job.bytes_written >> 8 : 0));
+  WirePeripheral.write((byte) (known ? job.bytes_written : 0));
+
+  if(debug_mode) {
+    DebugLog.print("Responded to I2C request from controller with write job ");
+    DebugLog.println(requested_job_id);
+  }
+}
+
+// Consumer side, removes only the events that fit into this response
+void writeEvents() {
+  uint8_t head = event_head;
+  uint8_t tail = event_tail;
+  uint8_t pending = (head - tail) & (EVENT_QUEUE_SIZE - 1);
+  uint8_t count = pending > EVENT_READ_MAX ? EVENT_READ_MAX : pending;
+  uint32_t dropped = events_dropped;
+  uint32_t new_dropped = dropped - events_dropped_reported;
+
+  __DMB();
+
+  writeUint32(millis());
+  WirePeripheral.write(count);
+  WirePeripheral.write((byte) (new_dropped > 0xFF ? 0xFF : new_dropped));
+
+  for(uint8_t i = 0; i < count; i++) {
+    const RfEvent &event = events[(tail + i) & (EVENT_QUEUE_SIZE - 1)];
+
+    WirePeripheral.write(event.type);
+    writeUint32(event.timestamp);
+  }
+
+  // Fixed length, so the controller always reads the whole response and no event is lost
+  for(uint8_t i = count; i < EVENT_READ_MAX; i++) {
+    WirePeripheral.write((byte) 0);
+    writeUint32(0);
+  }
+
+  event_tail = (tail + count) & (EVENT_QUEUE_SIZE - 1);
+  events_dropped_reported = dropped;
+
+  // Rest of the queue is left for the next read
+  if(pending > count) {
+    raiseAttention(ATTENTION_RF_EVENT);
   }
-}
\ No newline at end of file
+
+  if(debug_mode) {
+    DebugLog.print("Responded to I2C request from controller with ");
+    DebugLog.print(count);
+    DebugLog.println(" RF events.");
+  }
+}
+
+// EEPROM first, then the mailbox
+void writeBenchmarks() {
+  for(byte target = TARGET_EEPROM; target <= TARGET_MAILBOX; target++) {
+    const WriteBenchmark &benchmark = write_benchmarks[target];
+
+    writeUint32(benchmark.count);
+    writeUint32(benchmark.last);
+    writeUint32(benchmark.count > 0 ? benchmark.total / benchmark.count : 0);
+    writeUint32(benchmark.max);
+  }
+
+  if(debug_mode) {
+    DebugLog.println("Responded to I2C request from controller with write benchmarks.");
+  }
+}
+
+void writeReceiveTiming() {
+  writeUint32(receive_cycles);
+  writeUint32(receive_cycles_max);
+
+  if(debug_mode) {
+    DebugLog.println("Responded to I2C request from controller with receive timing.");
+  }
+}
+
+// Reading the reasons clears them and releases the line
+void writeAttention() {
+  noInterrupts();
+
+  byte reasons = attention_reasons;
+
+  attention_reasons = 0;
+  updateAttentionPin();
+
+  interrupts();
+
+  WirePeripheral.write((byte) PER_ADDRESS);
+  WirePeripheral.write(reasons);
+
+  if(debug_mode) {
+    DebugLog.print("Responded to I2C request from controller with attention reasons 0x");
+    DebugLog.println(reasons, 16);
+  }
+}
+
+void writeUint32(uint32_t value) {
+  char value_bytes[4] = {
+    (char) (value >> 24),
+    (char) (value >> 16),
+    (char) (value >> 8),
+    (char) value
+  };
+
+  WirePeripheral.write(value_bytes, 4);
+}
@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""Turns binary DebugLog records (lib/DebugLog) back into readable lines.
+
+Strings in flash are only sent by address, so the decoder needs the firmware
+image the component is running (.pio/build/<environment>/firmware.elf).
+
+    decode_log.py firmware.elf capture.bin
+    decode_log.py firmware.elf --port /dev/ttyUSB0  (needs pyserial)
+"""
+
+import argparse
+import struct
+import sys
+
+LOG_SYNC = 0xA5
+LOG_STRING = 0x01
+LOG_TEXT = 0x02
+LOG_INT = 0x03
+LOG_UINT = 0x04
+LOG_INT64 = 0x05
+LOG_UINT64 = 0x06
+LOG_CHAR = 0x07
+LOG_FLOAT = 0x08
+LOG_LINE = 0x09
+LOG_DROPPED = 0x0A
+
+# Payload size after the type byte, LOG_TEXT has a length byte instead
+PAYLOAD_SIZES = {
+    LOG_STRING: 4,
+    LOG_INT: 5,
+    LOG_UINT: 5,
+    LOG_INT64: 9,
+    LOG_UINT64: 9,
+    LOG_CHAR: 1,
+    LOG_FLOAT: 5,
+    LOG_LINE: 4,
+    LOG_DROPPED: 4,
+}
+
+
+class FirmwareImage:
+    """Loaded sections of a 32-bit little-endian ELF file, enough to read constant strings."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as file:
+            data = file.read()
+
+        if data[:4] != b'\x7fELF' or data[4] != 1 or data[5] != 1:
+            raise ValueError(f'{path} is not a 32-bit little-endian ELF file')
+
+        section_offset, = struct.unpack_from('<I', data, 0x20)
+        section_size, section_count = struct.unpack_from('<HH', data, 0x2E)
+
+        self.sections = []
+
+        for i in range(section_count):
+            _, kind, _, address, offset, size = struct.unpack_from('<IIIIII', data, section_offset + i * section_size)
+
+            # SHT_PROGBITS with an address, i.e. loaded into flash
+            if kind == 1 and address != 0:
+                self.sections.append((address, data[offset:offset + size]))
+
+    def string(self, address):
+        for start, content in self.sections:
+            if start <= address < start + len(content):
+                end = content.find(b'\0', address - start)
+                end = len(content) if end < 0 else end
+
+                return content[address - start:end].decode('utf-8', 'replace')
+
+        return f'<unknown string 0x{address:08X}>'
+
+
+def format_number(value, base):
+    if base == 16:
+        return f'{value:X}' if value >= 0 else f'-{-value:X}'
+    if base == 2:
+        return f'{value:b}'
+    if base == 8:
+        return f'{value:o}'
+
+    return str(value)
+
+
+def decode(stream, image, output):
+    line = []
+    buffer = bytearray()
+
+    for chunk in stream:
+        buffer += chunk
+
+        while True:
+            # Skips anything up to the next record, e.g. when started in the middle of the stream
+            start = buffer.find(LOG_SYNC)
+
+            if start < 0:
+                buffer.clear()
+                break
+
+            del buffer[:start]
+
+            if len(buffer) < 3:
+                break
+
+            kind = buffer[1]
+
+            if kind == LOG_TEXT:
+                size = 1 + buffer[2]
+            elif kind in PAYLOAD_SIZES:
+                size = PAYLOAD_SIZES[kind]
+            else:
+                del buffer[:1]
+                continue
+
+            if len(buffer) < 2 + size:
+                break
+
+            payload = bytes(buffer[2:2 + size])
+            del buffer[:2 + size]
+
+            if kind == LOG_STRING:
+                line.append(image.string(struct.unpack('<I', payload)[0]))
+            elif kind == LOG_TEXT:
+                line.append(payload[1:].decode('utf-8', 'replace'))
+            elif kind in (LOG_INT, LOG_UINT, LOG_INT64, LOG_UINT64):
+                signed = kind in (LOG_INT, LOG_INT64)
+                value = int.from_bytes(payload[1:], 'little', signed=signed)
+                line.append(format_number(value, payload[0]))
+            elif kind == LOG_CHAR:
+                line.append(chr(payload[0]))
+            elif kind == LOG_FLOAT:
+                line.append(f'{struct.unpack("<f", payload[1:])[0]:.{payload[0]}f}')
+            elif kind == LOG_LINE:
+                milliseconds, = struct.unpack('<I', payload)
+                output.write(f'[{milliseconds / 1000:10.3f}] {"".join(line)}\n')
+                output.flush()
+                line = []
+            elif kind == LOG_DROPPED:
+                dropped, = struct.unpack('<I', payload)
+                output.write(f'[{"":>10}] *** {dropped} records dropped, log buffer was full ***\n')
+
+
+def read_file(path):
+    with open(path, 'rb') as file:
+        while chunk := file.read(4096):
+            yield chunk
+
+
+def read_port(port, baud):
+    import serial
+
+    with serial.Serial(port, baud, timeout=0.1) as connection:
+        while True:
+            chunk = connection.read(4096)
+
+            if chunk:
+                yield chunk
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decodes binary DebugLog records into readable lines.')
+    parser.add_argument('firmware', help='firmware.elf the component is running')
+    parser.add_argument('capture', nargs='?', help='file with the raw bytes sent by the component (default: stdin)')
+    parser.add_argument('--port', help='read from a serial port instead (needs pyserial)')
+    parser.add_argument('--baud', type=int, default=115200)
+    arguments = parser.parse_args()
+
+    image = FirmwareImage(arguments.firmware)
+
+    if arguments.port:
+        stream = read_port(arguments.port, arguments.baud)
+    elif arguments.capture:
+        stream = read_file(arguments.capture)
+    else:
+        stream = iter(lambda: sys.stdin.buffer.read1(4096), b'')
+
+    try:
+        decode(stream, image, sys.stdout)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
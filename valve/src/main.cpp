@@ -1,11 +1,52 @@
 #define HB_TIMEOUT 7500 // WILL BE CHECKED 2 TIMES A SECOND
+#define IDLE_CLOCK_GATING 1 // 1 - FLASH AND SRAM (NOT WITH CURRENT_SENSE OR DEBUG_LOGGING) INTERFACE CLOCKS ARE STOPPED WHILE SLEEPING
+#define IDLE_STATS_WINDOW 1000 // MILLISECONDS IDLE TIME IS AVERAGED OVER
+#define DEFAULT_PEAK_TIME 100 // MILLISECONDS AT FULL DUTY AFTER OPENING
+#define DEFAULT_HOLD_DUTY 100 // PERCENT AFTER PEAK TIME, 100 DISABLES PEAK-AND-HOLD
+#define DEFAULT_PWM_FREQUENCY 20000 // HZ, ABOVE HEARING RANGE
+#define DEFAULT_SAFE_TIMEOUT 2000 // MILLISECONDS WITHOUT HEARTBEAT AFTER WHICH AN OPEN VALVE IS CLOSED, 0 DISABLES
+#define IWDG_TIMEOUT 2000 // MILLISECONDS, RESETS IF THE MAIN LOOP STALLS OR HEARTBEATS STOP AND THE SOFT RESET DOESN'T HAPPEN
+#define CURRENT_BUFFER_SIZE 1024 // ADC SAMPLES IN THE DMA RING BUFFER (~21MS), ONLY USED WITH CURRENT_SENSE
+#define CURRENT_AVERAGE 8 // ADC SAMPLES AVERAGED INTO ONE CURRENT VALUE
+#define CURRENT_OPEN_COIL_THRESHOLD 200 // ADC COUNTS, PEAK CURRENT BELOW THIS MEANS THE COIL ISN'T CONNECTED
+#define CURRENT_KICK_DROP 20 // ADC COUNTS, DIP BELOW PEAK CURRENT THAT COUNTS AS PLUNGER MOVEMENT
+#define CURRENT_KICK_WINDOW 150 // MILLISECONDS AFTER OPENING THE PLUNGER HAS TO MOVE IN, SHORTENED TO THE PEAK TIME WITH PEAK-AND-HOLD
+#define CURRENT_IDLE_THRESHOLD 100 // ADC COUNTS, CURRENT ABOVE THIS WHILE CLOSED MEANS THE OUTPUT IS STUCK ON
 
 #include <Arduino.h>
 #include <Wire.h>
+#include "DebugLog.h"
+#include <EEPROM.h>
+#include <IWatchdog.h>
 
 #define DEBUG_SWITCH_PIN PA11
 
-#define OUTPUT_PIN PB15
+#define OUTPUT_PIN PB15 // TIM1_CH3N
+#define ATTENTION_PIN PA4 // OPEN-DRAIN, ACTIVE LOW, CAN BE SHARED WITH OTHER COMPONENTS
+
+#ifdef CURRENT_SENSE
+#define CURRENT_SENSE_PIN PA0 // ADC12_IN0, shunt amplifier output
+#define CURRENT_SAMPLE_CYCLES 252 // 239.5 sampling + 12.5 conversion ADC cycles
+#define CURRENT_ADC_FREQUENCY 12000000 // PCLK2 / 6
+
+#define COIL_IDLE 0x00 // Valve closed
+#define COIL_PULL_IN 0x01 // Waiting for the plunger to move
+#define COIL_HELD 0x02 // Plunger moved (or kick window is over)
+
+#define COIL_FAULT_NONE 0x00
+#define COIL_FAULT_OPEN 0x01 // No current, coil or wiring broken
+#define COIL_FAULT_NO_KICK 0x02 // Current but no movement, plunger stuck
+#define COIL_FAULT_STUCK_ON 0x03 // Current while closed, MOSFET shorted
+#endif
+
+#ifdef MULTI_OUTPUT
+// Extra outputs are all on one port, so they are switched by a single BSRR write
+#define EXTRA_OUTPUT_PORT GPIOB
+#define EXTRA_OUTPUTS 7
+#define RECEIVE_DATA_SIZE (1 + (1 + EXTRA_OUTPUTS) * 4) // Timed outputs, mask and a duration per channel
+#else
+#define RECEIVE_DATA_SIZE 7 // Drive configuration
+#endif
 
 #define ON_LED_PIN PB12
 #define ACTIVE_LED_PIN PB13
@@ -13,20 +54,168 @@
 
 #define PER_SDA_PIN PB11
 #define PER_SCL_PIN PB10
+#define PER_ADDRESS 0x3F
+
+#define VALVE_CLOSED 0x00
+#define VALVE_OPEN 0x01 // Until closed by the controller
+#define VALVE_TIMED 0x02 // Closed by ValveTimer
+
+#define READ_VALVE_STATE 0x00
+#define READ_DRIVE_CONFIG 0x01
+#define READ_SAFETY_STATUS 0x02
+#define READ_OUTPUTS 0x03
+#define READ_COIL_STATUS 0x04
+#define READ_ATTENTION 0x05
+#define READ_IDLE_STATS 0x06
+
+#define ATTENTION_TIMED_CLOSE 0x01 // Timed valve or output closed by itself
+#define ATTENTION_SAFE_CLOSE 0x02 // Closed by the valve safe timeout
+#define ATTENTION_COIL_FAULT 0x04
+
+#define RESET_CAUSE_POWER_ON 0x00
+#define RESET_CAUSE_PIN 0x01
+#define RESET_CAUSE_HEARTBEAT 0x02 // Soft reset by heartbeatEvent()
+#define RESET_CAUSE_WATCHDOG 0x03 // IWDG
+#define RESET_CAUSE_SOFTWARE 0x04 // Soft reset from anywhere else
+
+// Not zeroed on reset, tells a heartbeat reset apart from other soft resets
+#define RETAINED __attribute__((section(".noinit")))
+#define HEARTBEAT_RESET_MAGIC 0x48425253 // "HBRS"
+
+#define VALVE_CONFIG_ADDRESS 0
+#define VALVE_CONFIG_MAGIC 0x56434631 // "VCF1"
+
+struct ValveConfig {
+  uint32_t magic;
+  uint16_t peak_time; // Milliseconds
+  uint8_t hold_duty; // Percent
+  uint8_t reserved;
+  uint32_t pwm_frequency; // Hz
+  uint16_t safe_timeout; // Milliseconds
+  uint16_t reserved_2;
+};
 
 TwoWire WirePeripheral(PER_SDA_PIN, PER_SCL_PIN);
-HardwareSerial Serial1(PA10, PA9);
 HardwareTimer HeartbeatTimer(TIM3);
+HardwareTimer ValveTimer(TIM2); // Free running at 1MHz, timestamps and closes the valve
+HardwareTimer DriveTimer(TIM1); // PWM on OUTPUT_PIN
 
+#ifdef DEBUG_LOGGING
 bool debug_mode = false;
+#else
+// Every if(debug_mode) block is compiled out, DebugLog isn't even defined
+constexpr bool debug_mode = false;
+#endif
 bool heartbeat_disable_reset_on_arrest = false;
 
-char output_byte = '\0';
 uint32_t last_heartbeat = 0;
 
+volatile byte valve_state = VALVE_CLOSED;
+volatile uint32_t valve_timer_overflows = 0;
+uint32_t valve_opened_at = 0; // Microseconds (ValveTimer)
+uint32_t valve_close_at = 0; // Microseconds (ValveTimer), only when timed
+uint32_t valve_open_time = 0; // Microseconds the valve was open the last time it closed
+uint32_t valve_hold_at = 0; // Microseconds (ValveTimer), end of peak time
+volatile bool valve_peak = false; // Full duty until valve_hold_at
+
+ValveConfig valve_config = { VALVE_CONFIG_MAGIC, DEFAULT_PEAK_TIME, DEFAULT_HOLD_DUTY, 0, DEFAULT_PWM_FREQUENCY, DEFAULT_SAFE_TIMEOUT, 0 };
+volatile bool valve_config_dirty = false;
+
+byte read_mode = READ_VALVE_STATE;
+
+volatile bool loop_work_pending = false; // Set by interrupts that leave work for loop()
+uint32_t idle_window_start = 0; // Milliseconds
+uint32_t idle_window_micros = 0; // Slept in the current window
+uint32_t idle_window_wakes = 0;
+uint16_t idle_permille = 0; // Of the last full window
+uint32_t idle_wakes = 0; // In the last full window
+volatile bool wake_pending = false; // Woken up, the interrupt that woke it hasn't run yet
+uint32_t wake_cycles = 0; // CPU cycles when woken up
+volatile uint32_t wake_latency = 0; // CPU cycles from waking up to the I2C callback that woke it
+volatile uint32_t wake_latency_max = 0;
+
+volatile byte attention_reasons = 0;
+byte attention_mask = 0xFF; // Reasons that pull the attention line low
+
+volatile uint32_t last_heartbeat_micros = 0; // Microseconds (ValveTimer)
+uint32_t safe_closes = 0; // Since boot
+byte reset_cause = RESET_CAUSE_POWER_ON;
+byte reset_flags = 0;
+uint32_t heartbeat_reset_marker RETAINED;
+
+#ifdef CURRENT_SENSE
+ADC_HandleTypeDef current_adc;
+DMA_HandleTypeDef current_dma;
+volatile uint16_t current_samples[CURRENT_BUFFER_SIZE]; // Written by DMA, never by the CPU
+uint16_t current_read_index = 0;
+volatile uint32_t current_processed_samples = 0;
+uint32_t current_last_processed = 0; // Milliseconds
+volatile uint32_t current_energized_at = 0; // Sample number of the last opening
+volatile bool current_energized = false; // Valve opened, not yet seen by processCurrentSamples()
+volatile uint32_t current_kick_window = 0; // Samples after the last opening a kick is looked for
+uint32_t current_sum = 0;
+uint8_t current_sum_count = 0;
+volatile uint16_t current_now = 0; // ADC counts, average of CURRENT_AVERAGE samples
+uint16_t coil_peak_current = 0; // ADC counts
+uint32_t coil_peak_sample = 0;
+uint32_t coil_stuck_on_since = 0; // Sample number, 0 if current is low
+volatile byte coil_state = COIL_IDLE;
+volatile byte coil_fault = COIL_FAULT_NONE;
+volatile uint32_t coil_actuations = 0;
+volatile uint32_t coil_faults = 0;
+volatile uint32_t coil_kick_time = 0; // Microseconds after opening
+volatile uint16_t coil_last_peak_current = 0; // ADC counts
+#endif
+
+#ifdef MULTI_OUTPUT
+const uint32_t extra_output_pins[EXTRA_OUTPUTS] = { PB0, PB1, PB5, PB6, PB7, PB8, PB9 }; // Channels 1 - 7
+const uint16_t extra_output_bits[EXTRA_OUTPUTS] = { GPIO_PIN_0, GPIO_PIN_1, GPIO_PIN_5, GPIO_PIN_6, GPIO_PIN_7, GPIO_PIN_8, GPIO_PIN_9 };
+volatile uint8_t extra_output_mask = 0; // Open extra outputs, bit 0 is channel 1
+volatile uint8_t extra_output_timed_mask = 0;
+uint32_t extra_output_opened_at[EXTRA_OUTPUTS]; // Microseconds (ValveTimer)
+uint32_t extra_output_close_at[EXTRA_OUTPUTS]; // Microseconds (ValveTimer), only when timed
+uint32_t extra_output_open_time[EXTRA_OUTPUTS]; // Microseconds the output was open the last time it closed
+#endif
+
 void requestEvent();
 void receiveEvent(int);
 void heartbeatEvent();
+void setupValveTimer();
+uint32_t valveMicros();
+void openValve();
+void openValveFor(uint32_t);
+void closeValve();
+void valveTimerOverflowEvent();
+void valveTimerCompareEvent();
+void valveTimerHoldEvent();
+void setupDrive();
+void energizeValve(uint32_t);
+void setDriveDuty(uint32_t);
+void loadValveConfig();
+void saveValveConfig();
+void readResetCause();
+#ifdef MULTI_OUTPUT
+void switchExtraOutputs(uint8_t, uint8_t, uint32_t);
+void scheduleExtraOutputs(uint32_t);
+void extraOutputTimerEvent();
+void writeOutputs();
+#endif
+#ifdef CURRENT_SENSE
+void setupCurrentSense();
+void processCurrentSamples();
+void processCurrent(uint16_t, uint32_t);
+void setCoilFault(byte);
+void writeCoilStatus();
+#endif
+void writeUint32(uint32_t);
+void raiseAttention(byte);
+void updateAttentionPin();
+void writeAttention();
+void idleSleep();
+uint32_t sleepMicros();
+void recordWakeLatency();
+void writeIdleStats();
+uint32_t readUint32(const char*);
 
 void setup() {
   pinMode(ON_LED_PIN, OUTPUT);
@@ -35,13 +224,29 @@ void setup() {
   
   pinMode(DEBUG_SWITCH_PIN, INPUT_PULLDOWN);
   
+  // Output stays low until the PWM channel takes over the pin
   pinMode(OUTPUT_PIN, OUTPUT);
+  digitalWrite(OUTPUT_PIN, LOW);
+
+  pinMode(ATTENTION_PIN, OUTPUT_OPEN_DRAIN);
+  digitalWrite(ATTENTION_PIN, HIGH);
+
+#ifdef MULTI_OUTPUT
+  for(byte i = 0; i < EXTRA_OUTPUTS; i++) {
+    pinMode(extra_output_pins[i], OUTPUT);
+    digitalWrite(extra_output_pins[i], LOW);
+  }
+#endif
 
   digitalWrite(ON_LED_PIN, LOW);
   digitalWrite(ACTIVE_LED_PIN, LOW);
   digitalWrite(ERROR_LED_PIN, LOW);
 
+  readResetCause();
+
+#ifdef DEBUG_LOGGING
   debug_mode = debug_mode || digitalRead(DEBUG_SWITCH_PIN);
+#endif
 
   if(debug_mode) {
     for(byte i = 0; i < 3; i++) {
@@ -64,65 +269,235 @@ void setup() {
   }
 
   if(debug_mode) {
-    Serial1.begin(115200);
-    Serial1.println("Start");
+    DebugLog.begin(115200);
+    DebugLog.println("Start");
     
-    Serial1.println("Debug mode enabled.");
+    DebugLog.println("Debug mode enabled.");
 
     if(heartbeat_disable_reset_on_arrest) {
-      Serial1.println("Heartbeat reset on arrest disabled.");
+      DebugLog.println("Heartbeat reset on arrest disabled.");
     } else {
-      Serial1.println("Heartbeat reset on arrest enabled.");
+      DebugLog.println("Heartbeat reset on arrest enabled.");
     }
+
+    DebugLog.print("Reset cause 0x");
+    DebugLog.print(reset_cause, 16);
+    DebugLog.print(", flags 0x");
+    DebugLog.println(reset_flags, 16);
   }
 
-  WirePeripheral.begin(0x3F);
+  loadValveConfig();
+  setupDrive();
+  setupValveTimer();
+#ifdef CURRENT_SENSE
+  setupCurrentSense();
+#endif
+
+  // DWT cycle counter measures wake-up latency
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+#if IDLE_CLOCK_GATING
+  // Only stopped while sleeping, an interrupt starts them again
+#if defined(CURRENT_SENSE) || defined(DEBUG_LOGGING)
+  // DMA keeps using SRAM (current samples, log) while sleeping
+  RCC->AHBENR &= ~RCC_AHBENR_FLITFEN;
+#else
+  RCC->AHBENR &= ~(RCC_AHBENR_FLITFEN | RCC_AHBENR_SRAMEN);
+#endif
+#endif
+
+  idle_window_start = millis();
+
+  WirePeripheral.begin(PER_ADDRESS);
   WirePeripheral.onRequest(requestEvent);
   WirePeripheral.onReceive(receiveEvent);
 
   last_heartbeat = millis();
 
+  noInterrupts();
+  last_heartbeat_micros = valveMicros();
+  interrupts();
+
   HeartbeatTimer.setOverflow(2, HERTZ_FORMAT);
   HeartbeatTimer.attachInterrupt(heartbeatEvent);
   HeartbeatTimer.resume();
 
+  // Backs up the heartbeat reset in case its timer interrupt never runs
+  IWatchdog.begin(IWDG_TIMEOUT * 1000);
+
   digitalWrite(ON_LED_PIN, HIGH);
 }
 
 void loop() {
+  // Stops being reloaded once heartbeats stop, so the watchdog resets even if heartbeatEvent() doesn't
+  if(heartbeat_disable_reset_on_arrest || millis() - last_heartbeat <= HB_TIMEOUT) {
+    IWatchdog.reload();
+  }
+
+#ifdef CURRENT_SENSE
+  processCurrentSamples();
+#endif
+
+  // Writing flash stalls the CPU and delays timed closes, so it waits until every output is closed
+#ifdef MULTI_OUTPUT
+  bool is_open = valve_state != VALVE_CLOSED || extra_output_mask != 0;
+#else
+  bool is_open = valve_state != VALVE_CLOSED;
+#endif
+
+  if(valve_config_dirty && !is_open) {
+    valve_config_dirty = false;
+    saveValveConfig();
+  }
+
+#ifdef DEBUG_LOGGING
+  DebugLog.drain();
+#endif
+
+  idleSleep();
 }
 
 void requestEvent() {
-  WirePeripheral.write(output_byte);
+  recordWakeLatency();
 
-  if(debug_mode) {
-    Serial1.print("Responded to I2C request from controller with value ");
-    Serial1.println(output_byte, 16);
+  if(read_mode == READ_ATTENTION) {
+    read_mode = READ_VALVE_STATE;
+
+    writeAttention();
+    return;
+  }
+
+  if(read_mode == READ_IDLE_STATS) {
+    read_mode = READ_VALVE_STATE;
+
+    writeIdleStats();
+    return;
+  }
+
+#ifdef CURRENT_SENSE
+  if(read_mode == READ_COIL_STATUS) {
+    read_mode = READ_VALVE_STATE;
+
+    writeCoilStatus();
+
+    if(debug_mode) {
+      DebugLog.println("Responded to I2C request from controller with coil status.");
+    }
+
+    return;
+  }
+#endif
+
+#ifdef MULTI_OUTPUT
+  if(read_mode == READ_OUTPUTS) {
+    read_mode = READ_VALVE_STATE;
+
+    writeOutputs();
+
+    if(debug_mode) {
+      DebugLog.println("Responded to I2C request from controller with all outputs.");
+    }
+
+    return;
+  }
+#endif
+
+  if(read_mode == READ_SAFETY_STATUS) {
+    read_mode = READ_VALVE_STATE;
+
+    WirePeripheral.write(reset_cause);
+    WirePeripheral.write(reset_flags);
+    WirePeripheral.write((byte) (valve_config.safe_timeout >> 8));
+    WirePeripheral.write((byte) valve_config.safe_timeout);
+    writeUint32(safe_closes);
+
+    if(debug_mode) {
+      DebugLog.println("Responded to I2C request from controller with safety status.");
+    }
+
+    return;
+  }
+
+  if(read_mode == READ_DRIVE_CONFIG) {
+    read_mode = READ_VALVE_STATE;
+
+    WirePeripheral.write((byte) (valve_config.peak_time >> 8));
+    WirePeripheral.write((byte) valve_config.peak_time);
+    WirePeripheral.write(valve_config.hold_duty);
+    writeUint32(valve_config.pwm_frequency);
+
+    if(debug_mode) {
+      DebugLog.println("Responded to I2C request from controller with drive configuration.");
+    }
+
+    return;
   }
 
-  output_byte = '\0';
+  noInterrupts();
+
+  byte state = valve_state;
+  uint32_t now = valveMicros();
+  uint32_t open_time = state == VALVE_CLOSED ? valve_open_time : now - valve_opened_at;
+  uint32_t remaining_time = state == VALVE_TIMED && (int32_t) (valve_close_at - now) > 0 ? valve_close_at - now : 0;
+
+  interrupts();
+
+  WirePeripheral.write(state);
+  writeUint32(open_time);
+  writeUint32(remaining_time);
+
+  if(debug_mode) {
+    DebugLog.print("Responded to I2C request from controller with state 0x");
+    DebugLog.print(state, 16);
+    DebugLog.print(", open time ");
+    DebugLog.print(open_time);
+    DebugLog.println(" us");
+  }
 }
 
 void receiveEvent(int how_many) {
+  recordWakeLatency();
+
+  // Drive configuration may have to be saved
+  loop_work_pending = true;
+
   if(debug_mode) {
-    Serial1.print("Receiving ");
-    Serial1.print(how_many);
-    Serial1.println(" bytes from controller.");
+    DebugLog.print("Receiving ");
+    DebugLog.print(how_many);
+    DebugLog.println(" bytes from controller.");
   }
 
   char command = '\0';
+  uint8_t data[RECEIVE_DATA_SIZE];
+  uint8_t data_length = 0;
+  bool data_overflow = false;
 
   while(WirePeripheral.available()) {
     if(!command) {
       command = (char) WirePeripheral.read();
+    } else if(data_length < RECEIVE_DATA_SIZE) {
+      data[data_length++] = WirePeripheral.read();
     } else {
+      // Still drained, so the next message starts clean
       WirePeripheral.read();
+      data_overflow = true;
     }
   }
 
   if(debug_mode) {
-    Serial1.print("Received command 0x");
-    Serial1.println(command, 16);
+    DebugLog.print("Received command 0x");
+    DebugLog.println(command, 16);
+  }
+
+  // Longer than any command
+  if(data_overflow) {
+    if(debug_mode) {
+      DebugLog.println("Received too much data.");
+    }
+
+    digitalWrite(ERROR_LED_PIN, HIGH);
+    return;
   }
 
   switch(command) {
@@ -132,38 +507,343 @@ void receiveEvent(int how_many) {
       {
         last_heartbeat = millis();
 
+        noInterrupts();
+        last_heartbeat_micros = valveMicros();
+        interrupts();
+
         if(debug_mode) {
-          Serial1.println("Received heartbeat.");
+          DebugLog.println("Received heartbeat.");
         }
       }
       break;
     case 0x02: // Turn valve on
       {
-        digitalWrite(OUTPUT_PIN, HIGH);
-        digitalWrite(ACTIVE_LED_PIN, HIGH);
+        openValve();
 
         if(debug_mode) {
-          Serial1.println("Turned valve on.");
+          DebugLog.println("Turned valve on.");
         }
       }
       break;
     case 0x03: // Turn valve off 
       {
-        digitalWrite(OUTPUT_PIN, LOW);
-        digitalWrite(ACTIVE_LED_PIN, LOW);
+        closeValve();
+
+        if(debug_mode) {
+          DebugLog.println("Turned valve off.");
+        }
+      }
+      break;
+    case 0x04: // Turn valve on for a number of milliseconds
+      {
+        if(data_length != 4) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for timed valve opening.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        uint32_t duration = readUint32((const char *) data);
+
+        // Closing time is kept as a signed offset of the 32-bit microsecond timer
+        if(duration == 0 || duration > 0x7FFFFFFF / 1000) {
+          if(debug_mode) {
+            DebugLog.println("Invalid duration for timed valve opening.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        openValveFor(duration);
+
+        if(debug_mode) {
+          DebugLog.print("Turned valve on for ");
+          DebugLog.print(duration);
+          DebugLog.println(" ms.");
+        }
+      }
+      break;
+    case 0x05: // Set drive configuration
+      {
+        if(data_length != 7) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for drive configuration.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        uint16_t peak_time = (data[0] << 8) | data[1];
+        uint8_t hold_duty = data[2];
+        uint32_t pwm_frequency = readUint32((const char *) data + 3);
+
+        if(hold_duty > 100 || pwm_frequency < 100 || pwm_frequency > 100000) {
+          if(debug_mode) {
+            DebugLog.println("Drive configuration out of range.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        noInterrupts();
+
+        valve_config.peak_time = peak_time;
+        valve_config.hold_duty = hold_duty;
+        valve_config.pwm_frequency = pwm_frequency;
+
+        // Duty is a share of the period, so it has to be set again for the new frequency
+        DriveTimer.setOverflow(pwm_frequency, HERTZ_FORMAT);
+        setDriveDuty(valve_state == VALVE_CLOSED ? 0 : valve_peak ? 100 : hold_duty);
+
+        interrupts();
+
+        valve_config_dirty = true;
 
         if(debug_mode) {
-          Serial1.println("Turned valve off.");
+          DebugLog.print("Set drive configuration: peak ");
+          DebugLog.print(peak_time);
+          DebugLog.print(" ms, hold ");
+          DebugLog.print(hold_duty);
+          DebugLog.print("% at ");
+          DebugLog.print(pwm_frequency);
+          DebugLog.println(" Hz.");
         }
       }
       break;
+    case 0x06: // Read drive configuration
+      {
+        read_mode = READ_DRIVE_CONFIG;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return drive configuration.");
+        }
+      }
+      break;
+    case 0x07: // Set valve safe timeout
+      {
+        if(data_length != 2) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for valve safe timeout.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+
+        valve_config.safe_timeout = (data[0] << 8) | data[1];
+        valve_config_dirty = true;
+
+        if(debug_mode) {
+          DebugLog.print("Set valve safe timeout to ");
+          DebugLog.print(valve_config.safe_timeout);
+          DebugLog.println(" ms.");
+        }
+      }
+      break;
+    case 0x08: // Read safety status
+      {
+        read_mode = READ_SAFETY_STATUS;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return safety status.");
+        }
+      }
+      break;
+    case 0x0E: // Set attention mask
+      {
+        if(data_length != 1) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for attention mask.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        noInterrupts();
+        attention_mask = data[0];
+        updateAttentionPin();
+        interrupts();
+
+        if(debug_mode) {
+          DebugLog.print("Set attention mask to 0x");
+          DebugLog.println(attention_mask, 16);
+        }
+      }
+      break;
+    case 0x0F: // Read attention
+      {
+        read_mode = READ_ATTENTION;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return attention reasons.");
+        }
+      }
+      break;
+    case 0x10: // Read idle statistics
+      {
+        read_mode = READ_IDLE_STATS;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return idle statistics.");
+        }
+      }
+      break;
+#ifdef CURRENT_SENSE
+    case 0x0C: // Read coil status
+      {
+        read_mode = READ_COIL_STATUS;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return coil status.");
+        }
+      }
+      break;
+    case 0x0D: // Clear coil fault
+      {
+        coil_fault = COIL_FAULT_NONE;
+        digitalWrite(ERROR_LED_PIN, LOW);
+
+        if(debug_mode) {
+          DebugLog.println("Cleared coil fault.");
+        }
+      }
+      break;
+#endif
+#ifdef MULTI_OUTPUT
+    case 0x09: // Set outputs
+      {
+        if(data_length != 1) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for setting outputs.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        uint8_t mask = data[0];
+        uint8_t extra_mask = mask >> 1;
+
+        noInterrupts();
+
+        uint32_t now = valveMicros();
+
+        switchExtraOutputs(extra_mask & ~extra_output_mask, ~extra_mask & extra_output_mask, now);
+        extra_output_timed_mask = 0;
+        scheduleExtraOutputs(now);
+
+        interrupts();
+
+        // Channel 0 is the PWM output, it follows right after the port write
+        if(mask & 0x01) {
+          openValve();
+        } else {
+          closeValve();
+        }
+
+        if(debug_mode) {
+          DebugLog.print("Set outputs to 0x");
+          DebugLog.println(mask, 16);
+        }
+      }
+      break;
+    case 0x0A: // Turn outputs on for a number of milliseconds
+      {
+        uint8_t mask = data_length > 0 ? data[0] : 0;
+        uint8_t channels = 0;
+
+        for(uint8_t bits = mask; bits; bits >>= 1) {
+          channels += bits & 0x01;
+        }
+
+        if(mask == 0 || data_length != 1u + channels * 4) {
+          if(debug_mode) {
+            DebugLog.println("Received invalid data for timed outputs.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        // Durations follow the mask in channel order
+        uint32_t durations[1 + EXTRA_OUTPUTS];
+        const char *duration_bytes = (const char *) data + 1;
+        bool is_valid = true;
+
+        for(uint8_t i = 0; i < 1 + EXTRA_OUTPUTS; i++) {
+          durations[i] = 0;
+
+          if(mask & (1 << i)) {
+            durations[i] = readUint32(duration_bytes);
+            duration_bytes += 4;
+
+            is_valid = is_valid && durations[i] > 0 && durations[i] <= 0x7FFFFFFF / 1000;
+          }
+        }
+
+        if(!is_valid) {
+          if(debug_mode) {
+            DebugLog.println("Invalid duration for timed outputs.");
+          }
+
+          digitalWrite(ERROR_LED_PIN, HIGH);
+          break;
+        }
+
+        uint8_t extra_mask = mask >> 1;
+
+        noInterrupts();
+
+        uint32_t now = valveMicros();
+
+        for(uint8_t i = 0; i < EXTRA_OUTPUTS; i++) {
+          if(extra_mask & (1 << i)) {
+            extra_output_close_at[i] = now + durations[i + 1] * 1000;
+          }
+        }
+
+        // Already open outputs stay open, the duration counts from now
+        switchExtraOutputs(extra_mask & ~extra_output_mask, 0, now);
+        extra_output_timed_mask |= extra_mask;
+        scheduleExtraOutputs(now);
+
+        interrupts();
+
+        if(mask & 0x01) {
+          openValveFor(durations[0]);
+        }
+
+        if(debug_mode) {
+          DebugLog.print("Turned outputs 0x");
+          DebugLog.print(mask, 16);
+          DebugLog.println(" on for a number of milliseconds.");
+        }
+      }
+      break;
+    case 0x0B: // Read all outputs
+      {
+        read_mode = READ_OUTPUTS;
+
+        if(debug_mode) {
+          DebugLog.println("Next read will return all outputs.");
+        }
+      }
+      break;
+#endif
     default:
       {
         digitalWrite(ERROR_LED_PIN, HIGH);
 
         if(debug_mode) {
-          Serial1.print("Unknown command 0x");
-          Serial1.println(command, 16);
+          DebugLog.print("Unknown command 0x");
+          DebugLog.println(command, 16);
         }
       }
   }
@@ -174,17 +854,671 @@ void heartbeatEvent() {
 
   if(diff > HB_TIMEOUT) {
     if(debug_mode && !heartbeat_disable_reset_on_arrest) {
-      Serial1.println("Heartbeat arrest.");
+      DebugLog.println("Heartbeat arrest.");
     }
 
     if(!heartbeat_disable_reset_on_arrest) {
       if(debug_mode) {
-        Serial1.println("Resetting...");
-        delay(50);
+        DebugLog.println("Resetting...");
+        DebugLog.flush();
       }
 
       digitalWrite(ERROR_LED_PIN, HIGH);
+      heartbeat_reset_marker = HEARTBEAT_RESET_MAGIC;
       HAL_NVIC_SystemReset();
     }
   }
-}
\ No newline at end of file
+}
+
+void setupValveTimer() {
+  ValveTimer.setPrescaleFactor(ValveTimer.getTimerClkFreq() / 1000000);
+  ValveTimer.setOverflow(0x10000, TICK_FORMAT);
+  // Prescaler is only loaded on an update event, otherwise the first period runs at the timer clock
+  // and the first overflow moves valveMicros() ahead by ~65ms
+  ValveTimer.refresh();
+  ValveTimer.attachInterrupt(valveTimerOverflowEvent);
+
+  // Compare matches every 65.536ms at the lower 16 bits of the closing time,
+  // the interrupt checks whether the upper bits match too
+  ValveTimer.setMode(1, TIMER_OUTPUT_COMPARE);
+  ValveTimer.attachInterrupt(1, valveTimerCompareEvent);
+
+  // Same for the end of peak time
+  ValveTimer.setMode(2, TIMER_OUTPUT_COMPARE);
+  ValveTimer.attachInterrupt(2, valveTimerHoldEvent);
+
+#ifdef MULTI_OUTPUT
+  // Same for the earliest closing time of extra outputs
+  ValveTimer.setMode(3, TIMER_OUTPUT_COMPARE);
+  ValveTimer.attachInterrupt(3, extraOutputTimerEvent);
+#endif
+
+  ValveTimer.resume();
+}
+
+// Must be called with interrupts disabled
+uint32_t valveMicros() {
+  uint32_t high = valve_timer_overflows;
+  uint32_t low = ValveTimer.getCount(TICK_FORMAT);
+
+  // The timer may have wrapped without the overflow interrupt having run yet
+  if(__HAL_TIM_GET_FLAG(ValveTimer.getHandle(), TIM_FLAG_UPDATE) && low < 0x8000) {
+    high++;
+  }
+
+  return (high << 16) | low;
+}
+
+void openValve() {
+  noInterrupts();
+
+  if(valve_state == VALVE_CLOSED) {
+    energizeValve(valveMicros());
+  }
+
+  valve_state = VALVE_OPEN;
+
+  interrupts();
+
+  digitalWrite(ACTIVE_LED_PIN, HIGH);
+}
+
+void openValveFor(uint32_t duration) {
+  noInterrupts();
+
+  uint32_t now = valveMicros();
+
+  if(valve_state == VALVE_CLOSED) {
+    energizeValve(now);
+  }
+
+  // Already open valve stays open, the duration counts from now
+  valve_close_at = now + duration * 1000;
+  valve_state = VALVE_TIMED;
+  ValveTimer.setCaptureCompare(1, valve_close_at & 0xFFFF, TICK_FORMAT);
+
+  interrupts();
+
+  digitalWrite(ACTIVE_LED_PIN, HIGH);
+}
+
+// Also called from valveTimerCompareEvent()
+void closeValve() {
+  noInterrupts();
+
+  if(valve_state != VALVE_CLOSED) {
+    setDriveDuty(0);
+    valve_open_time = valveMicros() - valve_opened_at;
+  }
+
+  valve_state = VALVE_CLOSED;
+  valve_peak = false;
+
+  interrupts();
+
+#ifdef MULTI_OUTPUT
+  digitalWrite(ACTIVE_LED_PIN, extra_output_mask ? HIGH : LOW);
+#else
+  digitalWrite(ACTIVE_LED_PIN, LOW);
+#endif
+}
+
+// Must be called with interrupts disabled
+void energizeValve(uint32_t now) {
+  setDriveDuty(100);
+  valve_opened_at = now;
+
+#ifdef CURRENT_SENSE
+  // Samples already in the buffer but not processed yet are from before the opening
+  uint16_t write_index = CURRENT_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(&current_dma);
+  uint16_t pending = (write_index + CURRENT_BUFFER_SIZE - current_read_index) % CURRENT_BUFFER_SIZE;
+
+  current_energized_at = current_processed_samples + pending;
+  current_energized = true;
+
+  // Dropping to hold duty dips the current as well, which mustn't be taken for a kick
+  uint32_t kick_window_time = CURRENT_KICK_WINDOW;
+
+  if(valve_config.hold_duty < 100 && valve_config.peak_time > 0 && valve_config.peak_time < kick_window_time) {
+    kick_window_time = valve_config.peak_time;
+  }
+
+  current_kick_window = (uint64_t) kick_window_time * CURRENT_ADC_FREQUENCY / 1000 / CURRENT_SAMPLE_CYCLES;
+#endif
+
+  // Plunger is pulled in at full current, then held with less
+  if(valve_config.hold_duty < 100 && valve_config.peak_time == 0) {
+    setDriveDuty(valve_config.hold_duty);
+  } else if(valve_config.hold_duty < 100) {
+    valve_hold_at = now + (uint32_t) valve_config.peak_time * 1000;
+    valve_peak = true;
+    ValveTimer.setCaptureCompare(2, valve_hold_at & 0xFFFF, TICK_FORMAT);
+  }
+}
+
+void setupDrive() {
+  DriveTimer.setMode(3, TIMER_OUTPUT_COMPARE_PWM1, OUTPUT_PIN);
+  DriveTimer.setOverflow(valve_config.pwm_frequency, HERTZ_FORMAT);
+  setDriveDuty(0);
+  DriveTimer.resume();
+}
+
+// 0 is constantly low, 100 constantly high
+void setDriveDuty(uint32_t duty) {
+  DriveTimer.setCaptureCompare(3, duty, PERCENT_COMPARE_FORMAT);
+}
+
+void loadValveConfig() {
+  ValveConfig stored_valve_config;
+
+  EEPROM.get(VALVE_CONFIG_ADDRESS, stored_valve_config);
+
+  if(stored_valve_config.magic == VALVE_CONFIG_MAGIC) {
+    valve_config = stored_valve_config;
+  }
+
+  if(debug_mode) {
+    DebugLog.print("Drive configuration: peak ");
+    DebugLog.print(valve_config.peak_time);
+    DebugLog.print(" ms, hold ");
+    DebugLog.print(valve_config.hold_duty);
+    DebugLog.print("% at ");
+    DebugLog.print(valve_config.pwm_frequency);
+    DebugLog.println(" Hz.");
+  }
+}
+
+void saveValveConfig() {
+  noInterrupts();
+  ValveConfig new_valve_config = valve_config;
+  interrupts();
+
+  const uint8_t *bytes = (const uint8_t *) &new_valve_config;
+
+  // Whole struct goes into the buffer first, so the flash page is erased only once
+  eeprom_buffer_fill();
+
+  for(uint32_t i = 0; i < sizeof(new_valve_config); i++) {
+    eeprom_buffered_write_byte(VALVE_CONFIG_ADDRESS + i, bytes[i]);
+  }
+
+  eeprom_buffer_flush();
+}
+
+// Also checks the valve safe timeout every 65.536ms, independently of heartbeatEvent()
+void valveTimerOverflowEvent() {
+  valve_timer_overflows++;
+
+  uint32_t safe_timeout = valve_config.safe_timeout;
+
+#ifdef MULTI_OUTPUT
+  bool is_open = valve_state != VALVE_CLOSED || extra_output_mask != 0;
+#else
+  bool is_open = valve_state != VALVE_CLOSED;
+#endif
+
+  if(is_open && safe_timeout > 0 && valveMicros() - last_heartbeat_micros > safe_timeout * 1000) {
+#ifdef MULTI_OUTPUT
+    noInterrupts();
+    switchExtraOutputs(0, extra_output_mask, valveMicros());
+    extra_output_timed_mask = 0;
+    interrupts();
+#endif
+    closeValve();
+    safe_closes++;
+    raiseAttention(ATTENTION_SAFE_CLOSE);
+
+    digitalWrite(ERROR_LED_PIN, HIGH);
+  }
+}
+
+void valveTimerCompareEvent() {
+  if(valve_state == VALVE_TIMED && (int32_t) (valveMicros() - valve_close_at) >= 0) {
+    closeValve();
+    raiseAttention(ATTENTION_TIMED_CLOSE);
+  }
+}
+
+void valveTimerHoldEvent() {
+  if(valve_peak && (int32_t) (valveMicros() - valve_hold_at) >= 0) {
+    valve_peak = false;
+    setDriveDuty(valve_config.hold_duty);
+  }
+}
+
+void readResetCause() {
+  reset_flags = RCC->CSR >> 24;
+
+  // Power on sets the pin reset flag too, so the order matters
+  if(reset_flags & (RCC_CSR_IWDGRSTF >> 24)) {
+    reset_cause = RESET_CAUSE_WATCHDOG;
+  } else if(reset_flags & (RCC_CSR_SFTRSTF >> 24)) {
+    reset_cause = heartbeat_reset_marker == HEARTBEAT_RESET_MAGIC ? RESET_CAUSE_HEARTBEAT : RESET_CAUSE_SOFTWARE;
+  } else if(reset_flags & (RCC_CSR_PORRSTF >> 24)) {
+    reset_cause = RESET_CAUSE_POWER_ON;
+  } else {
+    reset_cause = RESET_CAUSE_PIN;
+  }
+
+  heartbeat_reset_marker = 0;
+  __HAL_RCC_CLEAR_RESET_FLAGS();
+}
+
+#ifdef MULTI_OUTPUT
+// Must be called with interrupts disabled
+void switchExtraOutputs(uint8_t open_mask, uint8_t close_mask, uint32_t now) {
+  uint32_t set_bits = 0;
+  uint32_t reset_bits = 0;
+
+  for(uint8_t i = 0; i < EXTRA_OUTPUTS; i++) {
+    if(open_mask & (1 << i)) {
+      set_bits |= extra_output_bits[i];
+      extra_output_opened_at[i] = now;
+    } else if(close_mask & (1 << i)) {
+      reset_bits |= extra_output_bits[i];
+      extra_output_open_time[i] = now - extra_output_opened_at[i];
+    }
+  }
+
+  // Upper half of BSRR resets, lower half sets, all pins change at once
+  EXTRA_OUTPUT_PORT->BSRR = (reset_bits << 16) | set_bits;
+
+  extra_output_mask = (extra_output_mask | open_mask) & ~close_mask;
+
+  digitalWrite(ACTIVE_LED_PIN, extra_output_mask || valve_state != VALVE_CLOSED ? HIGH : LOW);
+}
+
+// Must be called with interrupts disabled
+void scheduleExtraOutputs(uint32_t now) {
+  int32_t earliest = 0x7FFFFFFF;
+
+  for(uint8_t i = 0; i < EXTRA_OUTPUTS; i++) {
+    if(extra_output_timed_mask & (1 << i) && (int32_t) (extra_output_close_at[i] - now) < earliest) {
+      earliest = (int32_t) (extra_output_close_at[i] - now);
+    }
+  }
+
+  if(extra_output_timed_mask) {
+    ValveTimer.setCaptureCompare(3, (now + earliest) & 0xFFFF, TICK_FORMAT);
+  }
+}
+
+void extraOutputTimerEvent() {
+  noInterrupts();
+
+  uint32_t now = valveMicros();
+  uint8_t due_mask = 0;
+
+  for(uint8_t i = 0; i < EXTRA_OUTPUTS; i++) {
+    if(extra_output_timed_mask & (1 << i) && (int32_t) (now - extra_output_close_at[i]) >= 0) {
+      due_mask |= 1 << i;
+    }
+  }
+
+  if(due_mask) {
+    switchExtraOutputs(0, due_mask, now);
+    extra_output_timed_mask &= ~due_mask;
+    raiseAttention(ATTENTION_TIMED_CLOSE);
+  }
+
+  scheduleExtraOutputs(now);
+
+  interrupts();
+}
+
+void writeOutputs() {
+  uint32_t open_times[1 + EXTRA_OUTPUTS];
+  uint32_t remaining_times[1 + EXTRA_OUTPUTS];
+
+  noInterrupts();
+
+  uint32_t now = valveMicros();
+  uint8_t mask = (extra_output_mask << 1) | (valve_state != VALVE_CLOSED ? 0x01 : 0x00);
+  uint8_t timed_mask = (extra_output_timed_mask << 1) | (valve_state == VALVE_TIMED ? 0x01 : 0x00);
+
+  open_times[0] = valve_state == VALVE_CLOSED ? valve_open_time : now - valve_opened_at;
+  remaining_times[0] = valve_state == VALVE_TIMED && (int32_t) (valve_close_at - now) > 0 ? valve_close_at - now : 0;
+
+  for(uint8_t i = 0; i < EXTRA_OUTPUTS; i++) {
+    bool is_open = extra_output_mask & (1 << i);
+    bool is_timed = extra_output_timed_mask & (1 << i);
+
+    open_times[i + 1] = is_open ? now - extra_output_opened_at[i] : extra_output_open_time[i];
+    remaining_times[i + 1] = is_timed && (int32_t) (extra_output_close_at[i] - now) > 0 ? extra_output_close_at[i] - now : 0;
+  }
+
+  interrupts();
+
+  WirePeripheral.write((byte) (1 + EXTRA_OUTPUTS));
+  WirePeripheral.write(mask);
+  WirePeripheral.write(timed_mask);
+
+  for(uint8_t i = 0; i < 1 + EXTRA_OUTPUTS; i++) {
+    writeUint32(open_times[i]);
+    writeUint32(remaining_times[i]);
+  }
+}
+#endif
+
+#ifdef CURRENT_SENSE
+void setupCurrentSense() {
+  pinMode(CURRENT_SENSE_PIN, INPUT_ANALOG);
+
+  RCC_PeriphCLKInitTypeDef clock_config = {};
+  clock_config.PeriphClockSelection = RCC_PERIPHCLK_ADC;
+  clock_config.AdcClockSelection = RCC_ADCPCLK2_DIV6;
+  HAL_RCCEx_PeriphCLKConfig(&clock_config);
+
+  __HAL_RCC_ADC1_CLK_ENABLE();
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  // ADC converts continuously and DMA fills the ring buffer, the CPU only reads it from loop()
+  current_dma.Instance = DMA1_Channel1;
+  current_dma.Init.Direction = DMA_PERIPH_TO_MEMORY;
+  current_dma.Init.PeriphInc = DMA_PINC_DISABLE;
+  current_dma.Init.MemInc = DMA_MINC_ENABLE;
+  current_dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+  current_dma.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+  current_dma.Init.Mode = DMA_CIRCULAR;
+  current_dma.Init.Priority = DMA_PRIORITY_LOW;
+
+  current_adc.Instance = ADC1;
+  current_adc.Init.ScanConvMode = ADC_SCAN_DISABLE;
+  current_adc.Init.ContinuousConvMode = ENABLE;
+  current_adc.Init.DiscontinuousConvMode = DISABLE;
+  current_adc.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+  current_adc.Init.DataAlign = ADC_DATAALIGN_RIGHT;
+  current_adc.Init.NbrOfConversion = 1;
+
+  ADC_ChannelConfTypeDef channel_config = {};
+  channel_config.Channel = ADC_CHANNEL_0;
+  channel_config.Rank = ADC_REGULAR_RANK_1;
+  channel_config.SamplingTime = ADC_SAMPLETIME_239CYCLES_5;
+
+  bool is_successful =
+    HAL_DMA_Init(&current_dma) == HAL_OK &&
+    HAL_ADC_Init(&current_adc) == HAL_OK &&
+    HAL_ADC_ConfigChannel(&current_adc, &channel_config) == HAL_OK &&
+    HAL_ADCEx_Calibration_Start(&current_adc) == HAL_OK;
+
+  __HAL_LINKDMA(&current_adc, DMA_Handle, current_dma);
+
+  // DMA interrupts stay disabled in the NVIC, nothing runs per sample
+  is_successful = is_successful && HAL_ADC_Start_DMA(&current_adc, (uint32_t *) current_samples, CURRENT_BUFFER_SIZE) == HAL_OK;
+
+  current_last_processed = millis();
+
+  if(!is_successful) {
+    digitalWrite(ERROR_LED_PIN, HIGH);
+
+    if(debug_mode) {
+      DebugLog.println("Failed to start current sensing.");
+    }
+  }
+}
+
+void processCurrentSamples() {
+  uint16_t write_index = CURRENT_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(&current_dma);
+
+  // Buffer has been overwritten (e.g. while writing flash), start over from the newest sample
+  if(millis() - current_last_processed > CURRENT_BUFFER_SIZE * CURRENT_SAMPLE_CYCLES / (CURRENT_ADC_FREQUENCY / 1000)) {
+    noInterrupts();
+    current_processed_samples += (write_index + CURRENT_BUFFER_SIZE - current_read_index) % CURRENT_BUFFER_SIZE;
+    current_read_index = write_index;
+    interrupts();
+
+    current_sum = 0;
+    current_sum_count = 0;
+  }
+
+  current_last_processed = millis();
+
+  while(current_read_index != write_index) {
+    current_sum += current_samples[current_read_index];
+    current_sum_count++;
+
+    noInterrupts();
+    current_read_index = (current_read_index + 1) % CURRENT_BUFFER_SIZE;
+    current_processed_samples++;
+    interrupts();
+
+    if(current_sum_count == CURRENT_AVERAGE) {
+      processCurrent(current_sum / CURRENT_AVERAGE, current_processed_samples);
+
+      current_sum = 0;
+      current_sum_count = 0;
+    }
+  }
+}
+
+// Current rises while the plunger is pulled in, its movement induces a dip (kick) before the current
+// rises again to the holding level. No kick means the plunger didn't move.
+void processCurrent(uint16_t current, uint32_t sample) {
+  uint32_t kick_window = (uint64_t) CURRENT_KICK_WINDOW * CURRENT_ADC_FREQUENCY / 1000 / CURRENT_SAMPLE_CYCLES;
+
+  current_now = current;
+
+  noInterrupts();
+  bool is_energized = current_energized && (int32_t) (sample - current_energized_at) >= 0;
+  bool is_closed = valve_state == VALVE_CLOSED;
+  uint32_t energized_at = current_energized_at;
+  uint32_t pull_in_window = current_kick_window;
+
+  if(is_energized) {
+    current_energized = false;
+  }
+
+  interrupts();
+
+  if(is_energized) {
+    coil_state = COIL_PULL_IN;
+    coil_peak_current = current;
+    coil_peak_sample = sample;
+    coil_stuck_on_since = 0;
+    return;
+  }
+
+  if(coil_state != COIL_IDLE && is_closed) {
+    coil_state = COIL_IDLE;
+    coil_last_peak_current = coil_peak_current;
+    coil_stuck_on_since = sample;
+  }
+
+  switch(coil_state) {
+    case COIL_IDLE:
+      {
+        // Current decays for a while after closing
+        if(current <= CURRENT_IDLE_THRESHOLD) {
+          coil_stuck_on_since = sample;
+        } else if(is_closed && sample - coil_stuck_on_since > kick_window && coil_fault != COIL_FAULT_STUCK_ON) {
+          setCoilFault(COIL_FAULT_STUCK_ON);
+        }
+      }
+      break;
+    case COIL_PULL_IN:
+      {
+        // Samples from hold duty are past the window, so they're never judged as a kick
+        if(sample - energized_at >= pull_in_window) {
+          coil_state = COIL_HELD;
+          coil_kick_time = 0;
+          coil_last_peak_current = coil_peak_current;
+
+          setCoilFault(coil_peak_current < CURRENT_OPEN_COIL_THRESHOLD ? COIL_FAULT_OPEN : COIL_FAULT_NO_KICK);
+        } else if(current > coil_peak_current) {
+          coil_peak_current = current;
+          coil_peak_sample = sample;
+        } else if(coil_peak_current >= CURRENT_OPEN_COIL_THRESHOLD && coil_peak_current - current >= CURRENT_KICK_DROP) {
+          // Plunger started moving at the peak
+          coil_state = COIL_HELD;
+          coil_actuations++;
+          coil_kick_time = (uint64_t) (coil_peak_sample - energized_at) * CURRENT_SAMPLE_CYCLES * 1000000 / CURRENT_ADC_FREQUENCY;
+          coil_last_peak_current = coil_peak_current;
+        }
+      }
+      break;
+    case COIL_HELD:
+      break;
+  }
+}
+
+void setCoilFault(byte fault) {
+  coil_fault = fault;
+  coil_faults++;
+  raiseAttention(ATTENTION_COIL_FAULT);
+
+  digitalWrite(ERROR_LED_PIN, HIGH);
+
+  if(debug_mode) {
+    DebugLog.print("Coil fault 0x");
+    DebugLog.println(fault, 16);
+  }
+}
+
+void writeCoilStatus() {
+  uint16_t current = current_now;
+  uint16_t peak_current = coil_last_peak_current;
+
+  WirePeripheral.write(coil_state);
+  WirePeripheral.write(coil_fault);
+  writeUint32(coil_actuations);
+  writeUint32(coil_faults);
+  writeUint32(coil_kick_time);
+  WirePeripheral.write((byte) (peak_current >> 8));
+  WirePeripheral.write((byte) peak_current);
+  WirePeripheral.write((byte) (current >> 8));
+  WirePeripheral.write((byte) current);
+}
+#endif
+
+void writeUint32(uint32_t value) {
+  char value_bytes[4] = {
+    (char) (value >> 24),
+    (char) (value >> 16),
+    (char) (value >> 8),
+    (char) value
+  };
+
+  WirePeripheral.write(value_bytes, 4);
+}
+
+uint32_t readUint32(const char* data_bytes) {
+  const uint8_t *bytes = (const uint8_t *) data_bytes;
+
+  return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
+}
+
+// Safe to call from any context, also with interrupts disabled
+void raiseAttention(byte reason) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  attention_reasons |= reason;
+  updateAttentionPin();
+
+  __set_PRIMASK(primask);
+}
+
+void updateAttentionPin() {
+  digitalWriteFast(digitalPinToPinName(ATTENTION_PIN), (attention_reasons & attention_mask) ? LOW : HIGH);
+}
+
+// Sleeps until the next interrupt, SysTick wakes it up at least every millisecond
+void idleSleep() {
+  // Interrupts are only masked, one arriving between the check and __WFI() still wakes it up
+  __disable_irq();
+
+  if(loop_work_pending) {
+    loop_work_pending = false;
+    __enable_irq();
+    return;
+  }
+
+  uint32_t sleep_start = sleepMicros();
+
+  __DSB();
+  __WFI();
+
+  idle_window_micros += sleepMicros() - sleep_start;
+  idle_window_wakes++;
+
+  wake_cycles = DWT->CYCCNT;
+  wake_pending = true;
+
+  // The interrupt that woke it up runs now
+  __enable_irq();
+
+  wake_pending = false;
+
+  uint32_t window = millis() - idle_window_start;
+
+  if(window >= IDLE_STATS_WINDOW) {
+    // Microseconds per millisecond
+    idle_permille = idle_window_micros / window > 1000 ? 1000 : idle_window_micros / window;
+    idle_wakes = idle_window_wakes;
+
+    idle_window_start += window;
+    idle_window_micros = 0;
+    idle_window_wakes = 0;
+  }
+}
+
+// micros() misses a SysTick interrupt that is pending while interrupts are masked
+uint32_t sleepMicros() {
+  uint32_t ticks = HAL_GetTick();
+  uint32_t value = SysTick->VAL;
+
+  if(SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+    ticks++;
+    value = SysTick->VAL;
+  }
+
+  uint32_t load = SysTick->LOAD + 1;
+
+  return ticks * 1000 + (load - value) * 1000 / load;
+}
+
+// Called first thing in I2C callbacks
+void recordWakeLatency() {
+  if(!wake_pending) {
+    return;
+  }
+
+  wake_pending = false;
+  wake_latency = DWT->CYCCNT - wake_cycles;
+
+  if(wake_latency > wake_latency_max) {
+    wake_latency_max = wake_latency;
+  }
+}
+
+void writeIdleStats() {
+  WirePeripheral.write((byte) (idle_permille >> 8));
+  WirePeripheral.write((byte) idle_permille);
+  writeUint32(idle_wakes);
+  writeUint32(wake_latency);
+  writeUint32(wake_latency_max);
+
+  if(debug_mode) {
+    DebugLog.println("Responded to I2C request from controller with idle statistics.");
+  }
+}
+
+// Reading the reasons clears them and releases the line
+void writeAttention() {
+  noInterrupts();
+
+  byte reasons = attention_reasons;
+
+  attention_reasons = 0;
+  updateAttentionPin();
+
+  interrupts();
+
+  WirePeripheral.write((byte) PER_ADDRESS);
+  WirePeripheral.write(reasons);
+
+  if(debug_mode) {
+    DebugLog.print("Responded to I2C request from controller with attention reasons 0x");
+    DebugLog.println(reasons, 16);
+  }
+}